@@ -24,6 +24,45 @@
 #include <stdio.h>
 #include "abc_api.h"
 
+/*
+ * A network read from an AIG has the module name of the run that
+ * saved it; the passthru instance added by the abc API refers to
+ * <toplevel>tmp
+ */
+static void fix_module_name (const std::string &file, const std::string &name)
+{
+  FILE *fp = fopen (file.c_str(), "r");
+  if (!fp) {
+    fatal_error ("Could not open `%s' file!", file.c_str());
+  }
+  std::string v;
+  char buf[char_buf_sz];
+  size_t sz;
+  while ((sz = fread (buf, 1, char_buf_sz, fp)) > 0) {
+    v.append (buf, sz);
+  }
+  fclose (fp);
+
+  size_t pos = (v.compare (0, 7, "module ") == 0) ? 0 : v.find ("\nmodule ");
+  if (pos == std::string::npos) {
+    return;
+  }
+  pos = v.find_first_not_of (" \n", pos);
+  pos += 7;
+  size_t end = v.find_first_of (" \t\n(", pos);
+  if (end == std::string::npos || v.compare (pos, end - pos, name) == 0) {
+    return;
+  }
+  v.replace (pos, end - pos, name);
+
+  fp = fopen (file.c_str(), "w");
+  if (!fp) {
+    fatal_error ("Could not open `%s' file!", file.c_str());
+  }
+  fwrite (v.data(), 1, v.size(), fp);
+  fclose (fp);
+}
+
 extern "C"
 bool abc_run (act_syn_info *s)
 {
@@ -59,8 +98,22 @@ bool abc_run (act_syn_info *s)
     fatal_error ("Unable to start ABC session!");
   }
 
-  if (!api->stdSynthesis ()) {
-    fatal_error ("Unable to run logic synthesis using ABC api");
+  if (!s->aig_in.empty()) {
+    /* optimized earlier, possibly for another library: only map */
+    if (!api->readAig (s->aig_in.c_str())) {
+      fatal_error ("Unable to read AIG `%s'", s->aig_in.c_str());
+    }
+  }
+  else {
+    if (!api->optimize ()) {
+      fatal_error ("Unable to run logic synthesis using ABC api");
+    }
+    if (!s->aig_out.empty() && !api->writeAig (s->aig_out.c_str())) {
+      fatal_error ("Unable to save AIG to `%s'", s->aig_out.c_str());
+    }
+  }
+  if (!api->techMap ()) {
+    fatal_error ("Unable to run technology mapping using ABC api");
   }
 
   if (config_exists ("synth.expropt.abc.use_constraints")) {
@@ -73,6 +126,9 @@ bool abc_run (act_syn_info *s)
   if (!api->endSession ()) {
     fatal_error ("Unable to end session with ABC");
   }
+  if (!s->aig_in.empty()) {
+    fix_module_name (s->v_out, s->toplevel + "tmp");
+  }
   return true;
 }
 
@@ -420,17 +420,59 @@ int AbcApi::stdSynthesis ()
 {
   Assert (_parent, "What?");
 
+  if (!optimize ()) {
+    return 0;
+  }
+  return techMap ();
+}
+
+int AbcApi::optimize ()
+{
+  Assert (_parent, "What?");
+
   if (!runCmd ("balance; rewrite -l; refactor -l; balance; rewrite -l; rewrite -lz; balance; refactor -lz; rewrite -lz; balance")) {
     return 0;
   }
 
-  if (!runCmd ("strash; ifraig; dc2; strash; &get -n; &dch -f; &nf; &put; upsize; dnsize")) {
+  if (!runCmd ("strash; ifraig; dc2; strash")) {
+    return 0;
+  }
+
+  return 1;
+}
+
+int AbcApi::techMap ()
+{
+  Assert (_parent, "What?");
+
+  if (!runCmd ("&get -n; &dch -f; &nf; &put; upsize; dnsize")) {
     return 0;
   }
 
   return 1;
 }
 
+int AbcApi::writeAig (const char *fn)
+{
+  char buf[char_buf_sz_abc];
+  Assert (_parent, "What?");
+
+  /* -s: keep the port names */
+  snprintf (buf, char_buf_sz_abc, "write_aiger -s %s", fn);
+  return runCmd (buf);
+}
+
+int AbcApi::readAig (const char *fn)
+{
+  char buf[char_buf_sz_abc];
+  Assert (_parent, "What?");
+
+  /* the liberty file and constraints read by startSession() are
+     not part of the network, and stay */
+  snprintf (buf, char_buf_sz_abc, "read_aiger %s", fn);
+  return runCmd (buf);
+}
+
 int AbcApi::runTiming ()
 {
   Assert (_parent, "What?");
@@ -558,7 +600,7 @@ static bool my_fgets (char **buf, int *buf_max, FILE *fp)
   (*buf)[0] = '\0';
   (*buf)[*buf_max-1] = '\0';
   if (fgets (*buf, *buf_max, fp)) {
-    while ((strlen ((*buf)+pos) == (*buf_max-1-pos)) &&
+    while ((strlen ((*buf)+pos) == (size_t)(*buf_max-1-pos)) &&
 	   !feof (fp) && ((*buf)[*buf_max-2] != '\n')) {
       REALLOC (*buf, char, 2*(*buf_max));
       pos = *buf_max-1;
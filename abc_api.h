@@ -51,6 +51,20 @@ public:
   
   int runCmd (const char *cmd);
   int stdSynthesis ();
+
+  /*
+   * stdSynthesis() in two steps: technology-independent optimization
+   * of the AIG, and then mapping and sizing with the liberty file
+   */
+  int optimize ();
+  int techMap ();
+
+  /*
+   * save the current (optimized) AIG, or replace the current network
+   * with one saved earlier
+   */
+  int writeAig (const char *fn);
+  int readAig (const char *fn);
   int runTiming ();
   int endSession ();
 
@@ -0,0 +1,478 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************/
+#include "expr_balance.h"
+#include <common/int.h>
+#include <queue>
+
+ExprBalance::ExprBalance (pHashtable *varwidths, iHashtable *leafmap)
+{
+  _vw = varwidths;
+  _leafmap = leafmap;
+  _refs = phash_new (8);
+  _done = phash_new (8);
+  _w = phash_new (8);
+  _carry_save = true;
+}
+
+ExprBalance::~ExprBalance ()
+{
+  phash_free (_refs);
+  phash_free (_done);
+  phash_free (_w);
+  for (auto e : _alloc) {
+    FREE (e);
+  }
+}
+
+/*
+ * The expression children of the node types we look inside; all
+ * other node types are treated as leaves.
+ */
+static int _children (Expr *e, Expr **ch)
+{
+  switch (e->type) {
+  case E_AND:
+  case E_OR:
+  case E_XOR:
+  case E_PLUS:
+  case E_MINUS:
+  case E_MULT:
+  case E_DIV:
+  case E_MOD:
+  case E_LSL:
+  case E_LSR:
+  case E_ASR:
+  case E_LT:
+  case E_GT:
+  case E_LE:
+  case E_GE:
+  case E_EQ:
+  case E_NE:
+    ch[0] = e->u.e.l;
+    ch[1] = e->u.e.r;
+    return 2;
+
+  case E_NOT:
+  case E_COMPLEMENT:
+  case E_UMINUS:
+  case E_BUILTIN_BOOL:
+  case E_BUILTIN_INT:
+  case E_BITFIELD:
+    ch[0] = e->u.e.l;
+    return 1;
+
+  case E_QUERY:
+    ch[0] = e->u.e.l;
+    ch[1] = e->u.e.r->u.e.l;
+    ch[2] = e->u.e.r->u.e.r;
+    return 3;
+
+  case E_CONCAT:
+    ch[0] = e->u.e.l;
+    if (e->u.e.r) {
+      ch[1] = e->u.e.r;
+      return 2;
+    }
+    return 1;
+
+  default:
+    return 0;
+  }
+}
+
+void ExprBalance::addRoot (Expr *e)
+{
+  phash_bucket_t *b;
+  Expr *ch[3];
+  int n;
+
+  b = phash_lookup (_refs, e);
+  if (b) {
+    b->i++;
+    return;
+  }
+  b = phash_add (_refs, e);
+  b->i = 1;
+
+  n = _children (e, ch);
+  for (int i=0; i < n; i++) {
+    addRoot (ch[i]);
+  }
+}
+
+/*
+ * Bit-width of an expression, following the same rules as
+ * _printExpr(). Returns -1 if the width cannot be determined.
+ */
+int ExprBalance::_width (Expr *e)
+{
+  phash_bucket_t *b;
+  int w, lw, rw;
+
+  b = phash_lookup (_w, e);
+  if (b) {
+    return b->i;
+  }
+
+  w = -1;
+  switch (e->type) {
+  case E_BUILTIN_BOOL:
+  case E_TRUE:
+  case E_FALSE:
+    w = 1;
+    break;
+
+  case E_BUILTIN_INT:
+    w = e->u.e.r ? e->u.e.r->u.ival.v : 1;
+    break;
+
+  case E_QUERY:
+    lw = _width (e->u.e.r->u.e.l);
+    rw = _width (e->u.e.r->u.e.r);
+    if (lw > 0 && rw > 0) {
+      w = act_expr_bitwidth (e->type, lw, rw);
+    }
+    break;
+
+  case E_LT:
+  case E_GT:
+  case E_LE:
+  case E_GE:
+  case E_EQ:
+  case E_NE:
+  case E_AND:
+  case E_OR:
+  case E_DIV:
+  case E_MOD:
+  case E_LSR:
+  case E_ASR:
+  case E_XOR:
+  case E_PLUS:
+  case E_MINUS:
+  case E_MULT:
+  case E_LSL:
+    lw = _width (e->u.e.l);
+    rw = _width (e->u.e.r);
+    if (lw > 0 && rw > 0) {
+      w = act_expr_bitwidth (e->type, lw, rw);
+    }
+    break;
+
+  case E_NOT:
+  case E_COMPLEMENT:
+  case E_UMINUS:
+    lw = _width (e->u.e.l);
+    if (lw > 0) {
+      w = act_expr_bitwidth (e->type, lw, 0);
+    }
+    break;
+
+  case E_INT:
+    if (_leafmap && ihash_lookup (_leafmap, (long) e)) {
+      w = 64;
+    }
+    else if (e->u.ival.v_extra) {
+      w = ((BigInt *) e->u.ival.v_extra)->getWidth();
+    }
+    else {
+      w = act_expr_intwidth (e->u.ival.v);
+    }
+    break;
+
+  case E_VAR:
+    {
+      phash_bucket_t *pb = phash_lookup (_vw, e);
+      if (pb) {
+	w = pb->i;
+      }
+    }
+    break;
+
+  case E_CONCAT:
+    lw = _width (e->u.e.l);
+    rw = e->u.e.r ? _width (e->u.e.r) : 0;
+    if (lw >= 0 && rw >= 0) {
+      w = lw + rw;
+    }
+    break;
+
+  case E_BITFIELD:
+    {
+      unsigned int l, r;
+      if (e->u.e.r->u.e.l) {
+	l = (unsigned long) e->u.e.r->u.e.r->u.ival.v;
+	r = (unsigned long) e->u.e.r->u.e.l->u.ival.v;
+      }
+      else {
+	l = (unsigned long) e->u.e.r->u.e.r->u.ival.v;
+	r = l;
+      }
+      lw = _width (e->u.e.l);
+      if (lw > 0) {
+	if (l >= (unsigned int) lw) {
+	  l = lw - 1;
+	}
+	w = (r > l) ? 1 : (l - r + 1);
+      }
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  b = phash_add (_w, e);
+  b->i = w;
+  return w;
+}
+
+Expr *ExprBalance::_node (int type, Expr *l, Expr *r, int w)
+{
+  Expr *e;
+  NEW (e, Expr);
+  e->type = type;
+  e->u.e.l = l;
+  e->u.e.r = r;
+  _alloc.push_back (e);
+
+  if (w >= 0) {
+    phash_bucket_t *b = phash_add (_w, e);
+    b->i = w;
+  }
+  return e;
+}
+
+/* int(e,w): zero-extend or truncate e to w bits */
+Expr *ExprBalance::_resize (Expr *e, int w)
+{
+  Expr *wexpr;
+  NEW (wexpr, Expr);
+  wexpr->type = E_INT;
+  wexpr->u.ival.v = w;
+  wexpr->u.ival.v_extra = NULL;
+  _alloc.push_back (wexpr);
+  return _node (E_BUILTIN_INT, e, wexpr, w);
+}
+
+Expr *ExprBalance::run (Expr *e)
+{
+  return _rebuild (e);
+}
+
+Expr *ExprBalance::_rebuild (Expr *e)
+{
+  phash_bucket_t *b;
+  Expr *ret = NULL;
+
+  b = phash_lookup (_done, e);
+  if (b) {
+    return (Expr *) b->v;
+  }
+
+  if (e->type == E_PLUS || e->type == E_AND ||
+      e->type == E_OR || e->type == E_XOR) {
+    /* flatten the chain; only look inside unshared nodes */
+    std::vector<Expr *> ops;
+    std::vector<Expr *> stk;
+    stk.push_back (e->u.e.r);
+    stk.push_back (e->u.e.l);
+    while (!stk.empty()) {
+      Expr *x = stk.back();
+      stk.pop_back();
+      phash_bucket_t *rb = phash_lookup (_refs, x);
+      if (x->type == e->type && rb && rb->i == 1) {
+	stk.push_back (x->u.e.r);
+	stk.push_back (x->u.e.l);
+      }
+      else {
+	ops.push_back (x);
+      }
+    }
+    if (ops.size() > 2) {
+      ret = _chain (e, ops);
+    }
+  }
+
+  if (!ret) {
+    Expr *ch[3], *nch[3];
+    int n = _children (e, ch);
+    bool changed = false;
+    for (int i=0; i < n; i++) {
+      nch[i] = _rebuild (ch[i]);
+      if (nch[i] != ch[i]) {
+	changed = true;
+      }
+    }
+    if (!changed) {
+      ret = e;
+    }
+    else if (e->type == E_QUERY) {
+      ret = _node (E_QUERY, nch[0],
+		   _node (E_COLON, nch[1], nch[2], -1), -1);
+    }
+    else {
+      /* for bitfields and int(), r holds constants and is kept */
+      ret = _node (e->type, nch[0], (n == 2) ? nch[1] : e->u.e.r, -1);
+    }
+  }
+
+  b = phash_add (_done, e);
+  b->v = ret;
+  return ret;
+}
+
+struct _balance_op {
+  int w;
+  int seq;
+  Expr *e;
+  bool operator< (const _balance_op &o) const {
+    /* std::priority_queue is a max-heap */
+    if (w != o.w) return w > o.w;
+    return seq > o.seq;
+  }
+};
+
+/*
+ * Rebuild a flattened chain rooted at e with operands ops. Returns
+ * NULL if the widths could not be determined.
+ */
+Expr *ExprBalance::_chain (Expr *e, std::vector<Expr *> &ops)
+{
+  int worig = _width (e);
+  if (worig <= 0) {
+    return NULL;
+  }
+
+  std::vector<Expr *> nops;
+  for (auto x : ops) {
+    Expr *y = _rebuild (x);
+    if (_width (y) <= 0) {
+      return NULL;
+    }
+    nops.push_back (y);
+  }
+
+  Expr *ret = NULL;
+  if (e->type == E_PLUS && _carry_save) {
+    ret = _carry_save_sum (nops);
+  }
+
+  if (!ret) {
+    /* narrowest two first */
+    std::priority_queue<_balance_op> pq;
+    int seq = 0;
+    for (auto x : nops) {
+      pq.push ({ _width (x), seq++, x });
+    }
+    while (pq.size() > 1) {
+      _balance_op a = pq.top(); pq.pop();
+      _balance_op b = pq.top(); pq.pop();
+      int w = act_expr_bitwidth (e->type, a.w, b.w);
+      pq.push ({ w, seq++, _node (e->type, a.e, b.e, w) });
+    }
+    ret = pq.top().e;
+  }
+
+  if (_width (ret) != worig) {
+    ret = _resize (ret, worig);
+  }
+  return ret;
+}
+
+/*
+ * Multi-operand addition as a tree of 3:2 compressors:
+ *
+ *    a + b + c = (a ^ b ^ c) + { maj(a,b,c), 1'b0 }
+ *
+ * All values are unsigned and never exceed the exact sum, so any
+ * intermediate can be truncated to the width of the exact sum.
+ */
+Expr *ExprBalance::_carry_save_sum (std::vector<Expr *> &ops)
+{
+  unsigned long long maxv = 0;
+  int wt;
+
+  if (ops.size() < 3) {
+    return NULL;
+  }
+  for (auto x : ops) {
+    int w = _width (x);
+    if (w > 62) {
+      return NULL;
+    }
+    unsigned long long m = (1ULL << w) - 1;
+    if (maxv > ~0ULL - m) {
+      return NULL;
+    }
+    maxv += m;
+  }
+  wt = 0;
+  while (maxv) {
+    wt++;
+    maxv >>= 1;
+  }
+  if (wt == 0) {
+    wt = 1;
+  }
+
+  std::priority_queue<_balance_op> pq;
+  int seq = 0;
+  for (auto x : ops) {
+    pq.push ({ _width (x), seq++, x });
+  }
+
+  while (pq.size() > 2) {
+    _balance_op a = pq.top(); pq.pop();
+    _balance_op b = pq.top(); pq.pop();
+    _balance_op c = pq.top(); pq.pop();
+
+    int wab = act_expr_bitwidth (E_XOR, a.w, b.w);
+    int w = act_expr_bitwidth (E_XOR, wab, c.w);
+
+    /* sum bits */
+    Expr *s = _node (E_XOR, _node (E_XOR, a.e, b.e, wab), c.e, w);
+
+    /* carry bits: (a & b) | (c & (a | b)), shifted left by one */
+    Expr *maj =
+      _node (E_OR,
+	     _node (E_AND, a.e, b.e, wab),
+	     _node (E_AND, c.e, _node (E_OR, a.e, b.e, wab),
+		    act_expr_bitwidth (E_AND, c.w, wab)),
+	     w);
+    Expr *zero;
+    NEW (zero, Expr);
+    zero->type = E_FALSE;
+    _alloc.push_back (zero);
+    Expr *cy = _node (E_CONCAT, maj, _node (E_CONCAT, zero, NULL, 1), w + 1);
+    int wcy = w + 1;
+    if (wcy > wt) {
+      cy = _resize (cy, wt);
+      wcy = wt;
+    }
+
+    pq.push ({ w, seq++, s });
+    pq.push ({ wcy, seq++, cy });
+  }
+
+  _balance_op a = pq.top(); pq.pop();
+  _balance_op b = pq.top(); pq.pop();
+  return _node (E_PLUS, a.e, b.e, act_expr_bitwidth (E_PLUS, a.w, b.w));
+}
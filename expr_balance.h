@@ -0,0 +1,91 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************/
+#ifndef __EXPR_BALANCE_H__
+#define __EXPR_BALANCE_H__
+
+#include <vector>
+#include "expropt.h"
+
+/**
+ * Reassociation of long chains of +, &, | and ^.
+ *
+ * CHP front-ends produce left-deep trees for a+b+c+d..., which turn
+ * into serial dependency chains in the generated Verilog. This pass
+ * flattens each chain and rebuilds it as a balanced tree, always
+ * combining the two narrowest operands first so that intermediate
+ * widths stay small. Multi-operand additions can instead be built as
+ * a carry-save (3:2 compressor) tree followed by a single adder.
+ *
+ * The result computes the same value at the same bit-width as the
+ * original expression (under the Verilog conventions used by
+ * _printExpr()). Leaves and unchanged sub-expressions are shared with
+ * the original expression; only new interior nodes are allocated,
+ * and these are owned by the ExprBalance object.
+ *
+ * Nodes that are referenced more than once are not flattened into
+ * their parent, so sharing in expression DAGs is preserved.
+ */
+class ExprBalance {
+public:
+  /**
+   * @param varwidths map from E_VAR leaves to their bit-width
+   * @param leafmap the leaf map used for printing (E_INT leaves that
+   * are in the map are 64 bits wide)
+   */
+  ExprBalance (pHashtable *varwidths, iHashtable *leafmap);
+
+  /* frees all the nodes created by run() */
+  ~ExprBalance ();
+
+  /* build carry-save adder trees for additions with 3+ operands */
+  void setCarrySave (bool v) { _carry_save = v; }
+
+  /**
+   * Register a root expression. All the roots that will be passed to
+   * run() must be registered first, so that shared sub-expressions
+   * are detected.
+   */
+  void addRoot (Expr *e);
+
+  /**
+   * Returns the reassociated expression for a registered root.
+   */
+  Expr *run (Expr *e);
+
+private:
+  pHashtable *_vw;		// leaf widths
+  iHashtable *_leafmap;		// leaf names
+  pHashtable *_refs;		// number of references to a node
+  pHashtable *_done;		// node -> reassociated node
+  pHashtable *_w;		// node -> width
+  bool _carry_save;
+
+  std::vector<Expr *> _alloc;	// nodes we created
+
+  int _width (Expr *e);
+  Expr *_node (int type, Expr *l, Expr *r, int w);
+  Expr *_resize (Expr *e, int w);
+  Expr *_rebuild (Expr *e);
+  Expr *_chain (Expr *e, std::vector<Expr *> &ops);
+  Expr *_carry_save_sum (std::vector<Expr *> &ops);
+};
+
+#endif /* __EXPR_BALANCE_H__ */
@@ -21,19 +21,50 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <iostream>
 #include <sstream>
+#include <chrono>
 #include "abc_api.h"
 #include "expr_cache.h"
+#include "expr_ir.h"
+#include "expr_cache_gc.h"
+#include "expr_cache_archive.h"
 #include <sys/file.h>   
+#include <sys/stat.h>
 #include <fcntl.h>    
 #include <unistd.h>    
+#include <signal.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <elf.h>
+#endif
 
 #include <filesystem>
 namespace fs = std::filesystem;
 
 expr_path to_expr_path (std::string x) {
-    return std::stoi(x);
+    return x;
+}
+
+/*
+    Entries are stored under two levels of directories named by the
+    leading hex digits of their key: <path>/ab/cd/abcd....v, so that
+    no directory gets too large, and the name of an entry follows from
+    its key.
+*/
+expr_path ExprCache::key_path (const expr_hash &uniq_id)
+{
+    return expr_cache_key_path(uniq_id);
+}
+
+std::string ExprCache::entry_file (const expr_path &loc)
+{
+    return path + "/" + loc;
 }
 
 std::string ExprCache::get_cache_loc()
@@ -48,7 +79,24 @@ std::string ExprCache::get_cache_loc()
     else {
         fatal_error ("Could not find local or global expression cache!");
     }
+    return _cache_dir(ret);
+}
 
+/*
+    The global cache, if a local one is used as well; "" otherwise.
+*/
+std::string ExprCache::get_global_cache_loc()
+{
+    if (!config_exists("synth.expropt.cache.local") ||
+        !config_exists("synth.expropt.cache.global")) {
+        return "";
+    }
+    std::string ret = _cache_dir(config_get_string("synth.expropt.cache.global"));
+    return (ret == get_cache_loc()) ? "" : ret;
+}
+
+std::string ExprCache::_cache_dir (std::string ret)
+{
     std::string techname = getenv("ACT_TECH");
     ret.append("/"+techname);
 
@@ -70,26 +118,44 @@ std::string ExprCache::get_cache_loc()
 
 ExprCache::~ExprCache()
 {
-    // save info for the ones to write out on exit
-    std::unordered_map<std::string, expr_path> path_map_save;
-    std::unordered_map<expr_path, ExprBlockInfo> info_map_save;
-    for ( auto x : dump_at_exit ) {
-        path_map_save.insert({x, path_map.at(x)});
-        info_map_save.insert({path_map_save.at(x), info_map.at(path_map_save.at(x))});
+    // once the new entries are in the index, what is left to do at
+    // exit is the access log, and keeping the cache within its budget
+    flush();
+    if (writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lk(writer_mu);
+            writer_exit = true;
+        }
+        writer_cv.notify_all();
+        writer.join();
     }
 
-    // clear maps and re-read coz someone else might have changed index file
-    int idx_fd = lock_file(index_file);
-    path_map.clear(); info_map.clear();
-    read_cache_unlocked(); 
-    for ( auto x : dump_at_exit ) {
-        if (!path_map.count(x)) {
-            path_map.insert({x, path_map_save.at(x)});
-            info_map.insert({path_map.at(x), info_map_save.at(path_map.at(x))});
-            write_cache_index_line_unlocked(x);
+    write_access_log();
+
+    // maintenance is left to the runs that have added entries, so
+    // that runs that only read never take the lock
+    if (wrote_index) {
+        int lock_fd = lock_file(lock_path);
+        read_cache();
+        if (max_entries && bindex.size() + journal_tail.size() > max_entries) {
+            expr_cache_budget budget = { max_entries, max_bytes };
+            expr_cache_gc_stats st;
+            if (!expr_cache_gc(path, budget, &st, true)) {
+                std::cerr << "Warning: garbage collection of " << path << " failed\n";
+            }
         }
+        else if (journal_tail.size() >= (size_t)index_rebuild_threshold) {
+            rebuild_index_unlocked();
+        }
+        unlock_file(lock_fd);
+    }
+
+    if (!stats_file.empty()) {
+        write_stats(stats_file);
     }
-    unlock_file(idx_fd);
+
+    delete key_ir;
+    delete archive;
 
     if (_syn_dlib) {
         dlclose (_syn_dlib);
@@ -104,7 +170,11 @@ int ExprCache::lock_file (std::string fn)
         std::cerr << "Failed to open " << fn << "\n"; 
         exit(1); 
     }
-    if (flock(fd, LOCK_EX) == -1) { 
+    auto start = std::chrono::steady_clock::now();
+    int ret = flock(fd, LOCK_EX);
+    stats.lock_wait_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - start).count();
+    if (ret == -1) { 
         std::cerr << "Failed to lock " << fn << "\n"; 
         close(fd); 
         exit(1); 
@@ -125,6 +195,93 @@ void ExprCache::unlock_file (int fd)
     }
 }
 
+std::string ExprCache::marker_file (const expr_hash &uniq_id)
+{
+    return path + "/" + uniq_id.hex() + ".inprogress";
+}
+
+/*
+    A marker is stale if its owner is gone: either it is a process on
+    this host that no longer exists, or the marker has not been
+    touched for inprogress_timeout seconds.
+*/
+bool ExprCache::marker_is_stale (const std::string &fn)
+{
+    struct stat st;
+    if (stat(fn.c_str(), &st) == -1) {
+        return false; // gone already, just retry
+    }
+    if (time(NULL) - st.st_mtime > inprogress_timeout) {
+        return true;
+    }
+
+    std::ifstream mf(fn);
+    std::string host;
+    long pid = 0;
+    if (!(mf >> host >> pid)) {
+        return false; // owner may still be writing it
+    }
+    char myhost[256];
+    if (gethostname(myhost, sizeof(myhost)) == -1) {
+        return false;
+    }
+    myhost[sizeof(myhost)-1] = '\0';
+    return host == myhost && kill((pid_t)pid, 0) == -1 && errno == ESRCH;
+}
+
+/*
+    Claim a key that is not in the cache. Creating the marker with 
+    O_EXCL is atomic, also on the shared file systems the cache lives 
+    on. If someone else holds the marker, wait until it is removed; 
+    their result is then normally in the index.
+*/
+bool ExprCache::claim_entry (const expr_hash &uniq_id)
+{
+    std::string fn = marker_file(uniq_id);
+    useconds_t wait = 10000;
+    while (true) {
+        int fd = open(fn.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd != -1) {
+            char host[256];
+            if (gethostname(host, sizeof(host)) == -1) {
+                strcpy(host, "unknown");
+            }
+            host[sizeof(host)-1] = '\0';
+            std::string owner = std::string(host) + " " + std::to_string(getpid()) + "\n";
+            if (write(fd, owner.c_str(), owner.size()) != (ssize_t)owner.size()) {
+                std::cerr << "Failed to write " << fn << "\n";
+                exit(1);
+            }
+            close(fd);
+            break;
+        }
+        if (errno != EEXIST) {
+            std::cerr << "Failed to create " << fn << "\n";
+            exit(1);
+        }
+        if (marker_is_stale(fn)) {
+            unlink(fn.c_str());
+            continue;
+        }
+        usleep(wait);
+        stats.marker_wait_us += wait;
+        wait = std::min(2*wait, (useconds_t)1000000);
+    }
+
+    // the previous owner may have finished in the meantime
+    read_cache();
+    if (find_entry(uniq_id)) {
+        release_entry(uniq_id);
+        return false;
+    }
+    return true;
+}
+
+void ExprCache::release_entry (const expr_hash &uniq_id)
+{
+    unlink(marker_file(uniq_id).c_str());
+}
+
 ExprCache::ExprCache(const char *datapath_synthesis_tool,
                      const expr_mapping_target mapping_target,
                      const bool tie_cells,
@@ -146,16 +303,79 @@ ExprCache::ExprCache(const char *datapath_synthesis_tool,
     }
 
     config_set_default_string("synth.expropt.cache.cell_lib_namespace", "syn");
+    index_rebuild_threshold = config_get_int("synth.expropt.cache.index_rebuild");
+    debug_keys = (config_get_int("synth.expropt.cache.debug_keys") != 0);
+    inprogress_timeout = config_get_int("synth.expropt.cache.inprogress_timeout");
+    stats_file = config_get_string("synth.expropt.cache.stats_file");
+    memset(&stats, 0, sizeof(stats));
+    max_entries = config_get_int("synth.expropt.cache.max_entries");
+    max_bytes = (uint64_t)config_get_int("synth.expropt.cache.max_size") << 20;
+    function_bits = config_get_int("synth.expropt.cache.function_bits");
+    key_functional = false;
+    key_ir = new ExprIR();
+    writer_exit = false;
+    wrote_index = false;
+    leaf_index_map = NULL;
+    leaf_index_n = 0;
+
+    // a packed cache (expropt-cache export) to use as a read-only tier
+    archive = NULL;
+    if (config_exists("synth.expropt.cache.archive")) {
+        archive = new ExprCacheArchive();
+        std::string arc_fn = config_get_string("synth.expropt.cache.archive");
+        if (!archive->open(arc_fn)) {
+            std::cerr << "Warning: could not open cache archive " << arc_fn << "\n";
+            delete archive;
+            archive = NULL;
+        }
+    }
+
+    // shared tier: read, and written only by publish()
+    global_path = get_global_cache_loc();
+    if (!global_path.empty()) {
+        read_global();
+    }
+
+    config_fp = _config_fingerprint(&config_desc, &aig_fp);
+
+    // optimized AIGs do not depend on the technology, so they are
+    // kept next to the <tech> directories; a miss that finds one
+    // (e.g. for a new library) only runs the mapping
+    aig_path = "";
+    if (mapper == "abc" && config_get_int("synth.expropt.cache.aig") != 0) {
+        aig_path = fs::path(path).parent_path().parent_path().string() + "/aig";
+    }
+
+    // everything that changes the v2act output
+    {
+        ExprHasher h;
+        h.add((long)wire_encoding);
+        h.add((long)use_tie_cells);
+        h.add(cell_namespace);
+        h.add(cell_act_file);
+        h.add(expr_channel_type);
+        act_tag = h.value().hex().substr(0, 8);
+    }
     
     // things to find and replace when storing in cache
     // just store the verilog file
 
     if (invalidate_cache) {
         Assert(!(path.empty()), "what");
-        std::string del_files_cmd = std::string("rm ") + std::string(path) + std::string("/*.act");
-        std::string del_index_cmd = std::string("rm ") + std::string(path) + std::string("/expr.index");
-        system(del_files_cmd.c_str());
-        system(del_index_cmd.c_str());
+        // everything but the lock: the index files, the access logs,
+        // and the sharded payload directories; and the stored AIGs,
+        // which the other technologies share
+        std::error_code ec;
+        std::vector<fs::path> old;
+        for (auto &d : fs::directory_iterator(path, ec)) {
+            if (d.path().filename() != expr_cache_lock_name) {
+                old.push_back(d.path());
+            }
+        }
+        for (auto &p : old) {
+            fs::remove_all(p, ec);
+        }
+        fs::remove_all(fs::path(path).parent_path().parent_path() / "aig", ec);
     }
 
     fs::path cache_path = path;
@@ -166,27 +386,37 @@ ExprCache::ExprCache(const char *datapath_synthesis_tool,
         }
     }
 
+    lock_path = path + "/" + expr_cache_lock_name;
     std::string index_filename = path + std::string("/expr.index");
     if (!fs::exists(index_filename)) {
-        int fd = lock_file(index_filename);
+        int fd = lock_file(lock_path);
         if (!fs::exists(index_filename)) { // gotta check again
             std::ofstream idx_file (index_filename, std::ios::app);
             if (!idx_file) {
                 std::cerr << "Error: could not create/open " << index_filename << std::endl;
                 exit(1);
             }
-            idx_file << "# ------------------------------------------------------------------------------------------------------------------------" << std::endl;
-            idx_file << "# Expression cache index and metrics file" << std::endl;
-            idx_file << "# Metrics except area are in triplets (min,typ,max)" << std::endl;
-            idx_file << "# Format: <unique_id> <file_name> <delay> <static power> <dynamic power> <total power> <area> <mapper_runtime> <io_runtime>" << std::endl;
-            idx_file << "# Type: <string> <int> <double (s)> <double (W)> <double (W)> <double (W)> <double (W)> <mapper_runtime (us)> <io_runtime (us)>" << std::endl;
-            idx_file << "# ------------------------------------------------------------------------------------------------------------------------" << std::endl;
+            idx_file << expr_cache_index_header();
             idx_file.close();
+            // a snapshot left over from an earlier journal does not
+            // describe this one
+            fs::remove(path + std::string("/expr.bidx"));
         }
         fs::permissions(index_filename, fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read | fs::perms::group_write, fs::perm_options::add);
         unlock_file(fd);
     }
     index_file = index_filename;
+
+    // what the configuration tag of the keys stands for
+    std::string desc_fn = path + "/config_" + config_fp.hex().substr(0, 16) + ".txt";
+    int desc_fd = open(desc_fn.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0664);
+    if (desc_fd != -1) {
+        if (write(desc_fd, config_desc.c_str(), config_desc.size()) != (ssize_t)config_desc.size()) {
+            std::cerr << "Warning: could not write " << desc_fn << "\n";
+        }
+        close(desc_fd);
+    }
+    bindex_file = path + std::string("/expr.bidx");
     idx_file_delimiter = ' ';
     path_map.clear();
     runtime_accessed_set.clear();
@@ -201,43 +431,468 @@ ExprCache::ExprCache(const char *datapath_synthesis_tool,
     n_cols = 2 + (3*n_metrics) + 1 + 2;
 
     // initialize cache counter
-    cache_counter = 0;
+    journal_pos = 0;
     read_cache();
 }
 
-std::string ExprCache::_gen_unique_id (Expr *e, iHashtable *expr_map, 
-                        iHashtable *width_map, int outwidth)
+static bool hash_file (const std::string &fn, ExprHasher &h)
 {
-    list_t *vars = list_new();
-    act_expr_collect_ids (vars, e);
-    std::string uniq_id = act_expr_to_string(vars, e);
-    std::string io_signature = "";
+    std::ifstream f(fn, std::ios::binary);
+    if (!f.is_open()) {
+        return false;
+    }
+    char buf[65536];
+    while (f.read(buf, sizeof(buf)) || f.gcount() > 0) {
+        h.add(buf, f.gcount());
+    }
+    return true;
+}
 
-    std::unordered_map<ActId *, Expr *> id_to_expr = {};
-    ihash_iter_t iter;
-    ihash_bucket_t *ib;
-    ihash_iter_init (expr_map, &iter);
-    while ((ib = ihash_iter_next (expr_map, &iter))) 
-    {
-        Expr *e1 = (Expr *)ib->key;
-        id_to_expr.insert({(ActId *)(e1->u.e.l), e1});
+/*
+    The GNU build id of an ELF file, from its PT_NOTE segments; this
+    only reads the headers, so it is cheap even for a large library.
+    Returns "" if the file has none.
+*/
+static std::string elf_build_id (const std::string &fn)
+{
+#if defined(__linux__)
+    std::ifstream f(fn, std::ios::binary);
+    Elf64_Ehdr eh;
+    if (!f.read((char *)&eh, sizeof(eh)) ||
+        memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh.e_ident[EI_CLASS] != ELFCLASS64) {
+        return "";
     }
+    for (unsigned i = 0; i < eh.e_phnum; i++) {
+        Elf64_Phdr ph;
+        f.seekg(eh.e_phoff + (uint64_t)i * eh.e_phentsize);
+        if (!f.read((char *)&ph, sizeof(ph))) {
+            return "";
+        }
+        if (ph.p_type != PT_NOTE || ph.p_filesz > (1 << 16)) {
+            continue;
+        }
+        std::vector<char> buf(ph.p_filesz);
+        f.seekg(ph.p_offset);
+        if (!f.read(buf.data(), buf.size())) {
+            return "";
+        }
+        size_t off = 0;
+        while (off + sizeof(Elf64_Nhdr) <= buf.size()) {
+            Elf64_Nhdr nh;
+            memcpy(&nh, buf.data() + off, sizeof(nh));
+            size_t name_off = off + sizeof(nh);
+            size_t desc_off = name_off + ((nh.n_namesz + 3) & ~3u);
+            size_t next = desc_off + ((nh.n_descsz + 3) & ~3u);
+            if (next > buf.size()) {
+                break;
+            }
+            if (nh.n_type == NT_GNU_BUILD_ID && nh.n_namesz == 4 &&
+                memcmp(buf.data() + name_off, "GNU", 4) == 0) {
+                std::string ret;
+                char hex[3];
+                for (unsigned j = 0; j < nh.n_descsz; j++) {
+                    snprintf(hex, sizeof(hex), "%02x", (unsigned char)buf[desc_off + j]);
+                    ret.append(hex);
+                }
+                return ret;
+            }
+            off = next;
+        }
+    }
+#endif
+    return "";
+}
 
-    for (listitem_t *li = list_first(vars); li; li = li->next) 
-    {
-        auto id = (ActId *)(list_value(li));
-        auto b = ihash_lookup(width_map, (long)(id_to_expr.at(id)));
+/*
+    Fingerprint of everything other than the expression that changes
+    the synthesized netlist and its metrics: the cell library, the
+    constraints, the Verilog generation options, and the synthesis
+    tool (its plugin holds the synthesis scripts). *desc is set to a
+    readable list of the inputs, and *aig to the fingerprint of the
+    ones that do not depend on the technology.
+*/
+expr_hash ExprCache::_config_fingerprint (std::string *desc, expr_hash *aig)
+{
+    ExprHasher h, ha;
+    desc->clear();
+    auto add = [&](const std::string &name, const std::string &val, bool tech = true) {
+        h.add(name);
+        h.add(val);
+        if (!tech) {
+            ha.add(name);
+            ha.add(val);
+        }
+        desc->append(name + " = " + val + "\n");
+    };
+    auto file_hash = [&](const std::string &fn) -> std::string {
+        ExprHasher fh;
+        if (!hash_file(fn, fh)) {
+            return "missing";
+        }
+        return fh.value().hex();
+    };
+
+    add("mapper", mapper, false);
+    std::string lib = config_get_string("synth.liberty.typical");
+    add("liberty", lib);
+    add("liberty_hash", file_hash(lib));
+    add("default_load", std::to_string(config_get_real("synth.expropt.default_load")));
+    if (config_exists("synth.expropt.driving_cell")) {
+        add("driving_cell", config_get_string("synth.expropt.driving_cell"));
+    }
+    int constr = 0;
+    if (config_exists("synth.expropt.abc.use_constraints")) {
+        constr = config_get_int("synth.expropt.abc.use_constraints");
+    }
+    add("use_constraints", std::to_string(constr));
+    add("tie_cells", std::to_string(use_tie_cells));
+    for ( auto opt : { "vectorize_all_ports", "canonical_verilog", 
+                       "reassociate", "carry_save_adders" } ) {
+        add(opt, std::to_string(config_get_int((std::string("synth.expropt.") + opt).c_str())), false);
+    }
+
+    // the tools do not change while we run, so these are only
+    // looked at once per process
+    const char *act_home = getenv("ACT_HOME");
+    std::string lib_dir = act_home ? std::string(act_home) + "/lib/" : "";
+    add("plugin", act_home ? file_hash(lib_dir + "act_extsyn_" + mapper + ".so") : "no ACT_HOME", false);
+    if (mapper == "abc") {
+        // too large to read every time; the build id names the build
+        static const std::string abc_id = [&]() -> std::string {
+            if (!act_home) {
+                return "no ACT_HOME";
+            }
+            std::string id = elf_build_id(lib_dir + "libabc.so");
+            return id.empty() ? file_hash(lib_dir + "libabc.so") : id;
+        }();
+        add("libabc", abc_id, false);
+    }
+    else if (mapper == "yosys") {
+        static const std::string yosys_ver = []() -> std::string {
+            std::string ver = "";
+            FILE *vp = popen("yosys -V 2>/dev/null", "r");
+            if (vp) {
+                char buf[256];
+                while (fgets(buf, sizeof(buf), vp)) {
+                    ver.append(buf);
+                }
+                pclose(vp);
+            }
+            while (!ver.empty() && isspace(ver.back())) {
+                ver.pop_back();
+            }
+            return ver;
+        }();
+        add("yosys", yosys_ver, false);
+    }
+    *aig = ha.value();
+    return h.value();
+}
+
+/*
+    The cache key is a 128-bit hash of a canonical form of the
+    expression and the widths of its inputs and output: operands of
+    commutative operators are sorted, and leaves are numbered by first
+    occurrence, so the names of the variables do not matter. 
+    Small expressions (unless functional is false) are keyed by their
+    truth table instead, so that equivalent ones share an entry.
+    leaves (if not NULL) is set to the variables in canonical order.
+*/
+expr_hash ExprCache::_gen_unique_id (Expr *e, iHashtable *expr_map, 
+                        iHashtable *width_map, int outwidth,
+                        std::vector<Expr *> *leaves, bool functional)
+{
+    // only the leaves of e are looked up, so that the cost does not
+    // depend on the size of a map shared by a whole process
+    key_ir->clear();
+    key_ir->setLeafInfo(NULL, [&](Expr *leaf, const char *) -> int {
+        auto b = ihash_lookup(width_map, (long)leaf);
+        if (!b) {
+            Expr *k = _leaf_expr(expr_map, leaf);
+            b = k ? ihash_lookup(width_map, (long)k) : NULL;
+        }
         Assert (b, "var. width not found");
-        int width = b->i;
-        // gotta append bitwidth   
-        io_signature.append("_");
-        io_signature.append(std::to_string(width));
+        return b->i;
+    });
+    key_ir->addRoot(e, outwidth);
+    expr_hash key = key_ir->canonicalHash(&key_perm);
+    key_functional = false;
+    if (functional && function_bits > 0) {
+        auto it = function_keys.find(key);
+        if (it == function_keys.end()) {
+            function_key f;
+            std::vector<int> perm, at(key_perm.size());
+            f.ok = key_ir->functionHash(function_bits, key_perm, &f.key, &perm);
+            for (size_t i=0; f.ok && i<key_perm.size(); i++) {
+                at[key_perm[i]] = i;
+            }
+            for (size_t i=0; f.ok && i<perm.size(); i++) {
+                f.order.push_back(at[perm[i]]);
+            }
+            it = function_keys.insert({key, f}).first;
+        }
+        if (it->second.ok) {
+            std::vector<int> perm = key_perm;
+            for (size_t i=0; i<perm.size(); i++) {
+                key_perm[i] = perm[it->second.order[i]];
+            }
+            key = it->second.key;
+            key_functional = true;
+        }
+    }
+    {
+        ExprHasher h;
+        h.add(&key, sizeof(key));
+        h.add(&aig_fp, sizeof(aig_fp));
+        aig_key = h.value();
+    }
+    {
+        // only entries made with the same configuration match
+        ExprHasher h;
+        h.add(&key, sizeof(key));
+        h.add(&config_fp, sizeof(config_fp));
+        key = h.value();
+    }
+    if (leaves) {
+        leaves->clear();
+        for ( auto l : key_perm ) {
+            Expr *k = _leaf_expr(expr_map, key_ir->node(key_ir->leaf(l).node).e);
+            Assert (k, "variable not found in variable map");
+            leaves->push_back(k);
+        }
+    }
+
+    if (debug_keys && !key_strings.contains(key)) {
+        list_t *vars = list_new();
+        act_expr_collect_ids (vars, e);
+        std::string uniq_id = act_expr_to_string(vars, e);
+        list_free(vars);
+        for ( auto l : key_perm ) {
+            uniq_id.append("_");
+            uniq_id.append(std::to_string(key_ir->leaf(l).width));
+        }
+        uniq_id.append("_");
+        uniq_id.append(std::to_string(outwidth));
+        key_strings.insert({key, uniq_id});
+    }
+    return key;
+}
+
+/*
+    The key of expr_map for a leaf of an expression: the leaf itself,
+    or an entry with the same ActId. Returns NULL if there is none.
+*/
+Expr *ExprCache::_leaf_expr (iHashtable *expr_map, Expr *leaf)
+{
+    if (ihash_lookup(expr_map, (long)leaf)) {
+        return leaf;
+    }
+    if (leaf->type != E_VAR) {
+        return NULL;
     }
-    io_signature.append("_");
-    io_signature.append(std::to_string(outwidth));
+    ActId *id = (ActId *)leaf->u.e.l;
+    // a different map, or one that changed size, needs a new index;
+    // an entry that is no longer a key was replaced in the same map
+    bool stale = (leaf_index_map != expr_map || leaf_index_n != expr_map->n);
+    for (int pass=0; pass<2; pass++) {
+        if (stale) {
+            leaf_index.clear();
+            ihash_iter_t iter;
+            ihash_bucket_t *ib;
+            ihash_iter_init (expr_map, &iter);
+            while ((ib = ihash_iter_next (expr_map, &iter))) {
+                Expr *e1 = (Expr *)ib->key;
+                if (e1->type == E_VAR) {
+                    leaf_index.insert({(ActId *)(e1->u.e.l), e1});
+                }
+            }
+            leaf_index_map = expr_map;
+            leaf_index_n = expr_map->n;
+        }
+        auto it = leaf_index.find(id);
+        if (it == leaf_index.end()) {
+            return NULL;
+        }
+        if (ihash_lookup(expr_map, (long)it->second)) {
+            return it->second;
+        }
+        if (stale) {
+            break;
+        }
+        stale = true;
+    }
+    return NULL;
+}
+
+/*
+    Key of a multi-output block. Leaves are identified by name, so
+    that the output expressions can refer to hidden expressions. The
+    structural hash covers the expressions and their widths; the key
+    adds which canonical leaves are hidden wires, the widths of all
+    input ports (including unused ones), and the outputs and hidden
+    expressions that share a name. Returns false if the names cannot
+    be made canonical, e.g. an output that is also an input.
+*/
+bool ExprCache::_gen_block_id (list_t *in_expr_list, iHashtable *in_expr_map,
+                               iHashtable *in_width_map,
+                               list_t *out_expr_list, list_t *out_expr_name_list,
+                               iHashtable *out_width_map,
+                               list_t *hidden_expr_list, list_t *hidden_expr_name_list,
+                               expr_hash *key, block_ports *ports)
+{
+    std::unordered_map<std::string, int> widths = {};
+    std::unordered_map<std::string, int> hidden_first = {};
+    std::unordered_map<std::string, Expr *> in_first = {};
+    std::vector<std::string> in_order = {};
+    std::vector<int> out_first = {};
+    std::vector<int> hid_first = {};
+    listitem_t *li, *li_name;
+
+    // hidden expressions: hid_<k>, k the first one with the name
+    if (hidden_expr_list) {
+        li_name = list_first(hidden_expr_name_list);
+        for (li = list_first(hidden_expr_list); li; li = list_next(li)) {
+            Assert (li_name, "hidden name list and expr list dont have the same length");
+            std::string nm = (char *)list_value(li_name);
+            li_name = list_next(li_name);
+            auto b = ihash_lookup(out_width_map, (long)list_value(li));
+            Assert (b, "hidden expr. width not found");
+            if (!hidden_first.contains(nm)) {
+                hidden_first.insert({nm, hid_first.size()});
+                ports->canon.insert({nm, "hid_" + std::to_string(hid_first.size())});
+                widths.insert({nm, b->i});
+            }
+            hid_first.push_back(hidden_first.at(nm));
+            ports->hidden_names.push_back(ports->canon.at(nm));
+        }
+    }
+
+    for (li = list_first(in_expr_list); li; li = list_next(li)) {
+        auto b = ihash_lookup(in_expr_map, (long)list_value(li));
+        Assert (b, "variable not found in variable map");
+        std::string nm = (char *)b->v;
+        if (hidden_first.contains(nm)) {
+            return false;
+        }
+        if (!in_first.contains(nm)) {
+            auto w = ihash_lookup(in_width_map, (long)list_value(li));
+            Assert (w, "var. width not found");
+            in_first.insert({nm, (Expr *)list_value(li)});
+            in_order.push_back(nm);
+            widths.insert({nm, w->i});
+        }
+    }
+
+    // outputs: out_<j>, j the first one with the name
+    std::unordered_map<std::string, int> out_idx = {};
+    li_name = list_first(out_expr_name_list);
+    for (li = list_first(out_expr_list); li; li = list_next(li)) {
+        Assert (li_name, "output name list and output expr list dont have the same length");
+        std::string nm = (char *)list_value(li_name);
+        li_name = list_next(li_name);
+        if (in_first.contains(nm) || hidden_first.contains(nm)) {
+            return false;
+        }
+        if (!out_idx.contains(nm)) {
+            out_idx.insert({nm, out_first.size()});
+            ports->canon.insert({nm, "out_" + std::to_string(out_first.size())});
+        }
+        out_first.push_back(out_idx.at(nm));
+        ports->out_names.push_back(ports->canon.at(nm));
+    }
+
+    key_ir->clear();
+    key_ir->setLeafInfo(in_expr_map, [&](Expr *, const char *nm) -> int {
+        auto it = nm ? widths.find(nm) : widths.end();
+        return (it == widths.end()) ? -1 : it->second;
+    });
+    li_name = hidden_expr_list ? list_first(hidden_expr_name_list) : NULL;
+    for (li = hidden_expr_list ? list_first(hidden_expr_list) : NULL; li; li = list_next(li)) {
+        key_ir->addRoot((Expr *)list_value(li), 
+                        ihash_lookup(out_width_map, (long)list_value(li))->i,
+                        (char *)list_value(li_name));
+        li_name = list_next(li_name);
+    }
+    li_name = list_first(out_expr_name_list);
+    for (li = list_first(out_expr_list); li; li = list_next(li)) {
+        auto b = ihash_lookup(out_width_map, (long)list_value(li));
+        Assert (b, "output width not found");
+        key_ir->addRoot((Expr *)list_value(li), b->i, (char *)list_value(li_name));
+        li_name = list_next(li_name);
+    }
+    expr_hash ir_key = key_ir->canonicalHash(&key_perm);
+
+    ExprHasher h;
+    h.add(std::string("block"));
+    h.add(&ir_key, sizeof(ir_key));
+    // canonical leaves: a hidden wire, or the next input port
+    for ( auto l : key_perm ) {
+        const char *nm = key_ir->leaf(l).name;
+        if (!nm) {
+            return false;
+        }
+        if (hidden_first.contains(nm)) {
+            h.add((long)hidden_first.at(nm));
+        }
+        else if (in_first.contains(nm)) {
+            if (!ports->canon.contains(nm)) {
+                ports->canon.insert({nm, expr_prefix + std::to_string(ports->inputs.size())});
+                ports->inputs.push_back(in_first.at(nm));
+                h.add((long)widths.at(nm));
+            }
+            h.add(-1L);
+        }
+        else {
+            // neither a port nor a hidden wire
+            return false;
+        }
+    }
+    // input ports that are not used, in list order
+    h.add(-2L);
+    for ( auto &nm : in_order ) {
+        if (!ports->canon.contains(nm)) {
+            ports->canon.insert({nm, expr_prefix + std::to_string(ports->inputs.size())});
+            ports->inputs.push_back(in_first.at(nm));
+            h.add((long)widths.at(nm));
+        }
+    }
+    h.add(-3L);
+    for ( auto x : out_first ) {
+        h.add((long)x);
+    }
+    h.add(-4L);
+    for ( auto x : hid_first ) {
+        h.add((long)x);
+    }
+    ExprHasher ha = h;
+    ha.add(&aig_fp, sizeof(aig_fp));
+    aig_key = ha.value();
+    // only entries made with the same configuration match
+    h.add(&config_fp, sizeof(config_fp));
+    *key = h.value();
 
-    uniq_id.append(io_signature);
-    return uniq_id;
+    for ( auto &x : ports->canon ) {
+        if (x.first != x.second) {
+            ports->finds.push_back(x.second);
+            ports->replaces.push_back(x.first);
+        }
+    }
+
+    if (debug_keys && !key_strings.contains(*key)) {
+        std::string desc = "";
+        li_name = list_first(out_expr_name_list);
+        for (li = list_first(out_expr_list); li; li = list_next(li)) {
+            list_t *vars = list_new();
+            act_expr_collect_ids (vars, (Expr *)list_value(li));
+            desc.append(ports->canon.at((char *)list_value(li_name)) + "=");
+            desc.append(act_expr_to_string(vars, (Expr *)list_value(li)) + ";");
+            list_free(vars);
+            li_name = list_next(li_name);
+        }
+        key_strings.insert({*key, desc});
+    }
+    return true;
 }
 
 ExprBlockInfo *ExprCache::synth_expr (int targetwidth,
@@ -246,177 +901,1229 @@ ExprBlockInfo *ExprCache::synth_expr (int targetwidth,
                                       iHashtable *in_expr_map,
                                       iHashtable *in_width_map)
 {
-    std::string uniq_id = _gen_unique_id(expr, in_expr_map, in_width_map, targetwidth);
+    std::vector<Expr *> leaves;
+    expr_hash uniq_id = _gen_unique_id(expr, in_expr_map, in_width_map, targetwidth, &leaves);
+    bool found = find_entry(uniq_id) || find_global(uniq_id) || find_archived(uniq_id);
+    if (!found && key_functional) {
+        // entries made before function keys have the structural key
+        std::vector<Expr *> s_leaves;
+        expr_hash s_id = _gen_unique_id(expr, in_expr_map, in_width_map, targetwidth, 
+                                        &s_leaves, false);
+        found = find_entry(s_id) || find_global(s_id) || find_archived(s_id);
+        if (found) {
+            uniq_id = s_id;
+            leaves = s_leaves;
+        }
+        else {
+            // back to the function key (and its leaf order) for the miss
+            _gen_unique_id(expr, in_expr_map, in_width_map, targetwidth);
+        }
+    }
 
     // already have it
-    if (path_map.contains(uniq_id)) {
+    uint64_t *count = &stats.hits;
+    if (found) {
         auto idx = path_map.at(uniq_id);
         Assert (info_map.contains(idx), "Could not find path to cached process.");
     }
-    // gotta synth and add to cache
+    // gotta synth and add to cache, unless someone else is already
+    // doing that; then claim_entry waits for their result
+    else if (!claim_entry(uniq_id)) {
+        count = &stats.waits;
+    }
     else {
-        // this is just so that the cache only has one writer at a time
-        int idx_fd = lock_file(index_file); 
-        
-        ExprBlockInfo *ebi = run_external_opt(uniq_id, targetwidth, expr, 
-                                in_expr_list, in_expr_map, in_width_map, false);
-        ebi->setID(uniq_id);
-        auto verilogfile = ebi->getMappedFile();
-        auto presynfile = ebi->getUnmappedFile();
+        count = &stats.misses;
+        // the cached block uses canonical port names: in_<i> is
+        // canonical leaf i. Every occurrence of a variable needs a name.
+        list_t *c_list = list_new();
+        iHashtable *c_map = ihash_new(4);
+        for (size_t i=0; i<leaves.size(); i++) {
+            list_append(c_list, leaves[i]);
+            ihash_add(c_map, (long)leaves[i])->i = i;
+        }
+        std::vector<int> canon(key_ir->numLeaves());
+        for (size_t i=0; i<key_perm.size(); i++) {
+            canon[key_perm[i]] = i;
+        }
+        for (int i=0; i<key_ir->numNodes(); i++) {
+            auto &n = key_ir->node(i);
+            if (n.type == E_VAR && !ihash_lookup(c_map, (long)n.e)) {
+                ihash_add(c_map, (long)n.e)->i = canon[n.leaf];
+            }
+        }
+        std::string aig = _aig_begin();
+        ExprBlockInfo *ebi = run_external_opt(uniq_id.hex(), targetwidth, expr, 
+                                c_list, c_map, in_width_map, false);
+        _aig_end(aig);
+        list_free(c_list);
+        ihash_free(c_map);
+        _publish_entry(uniq_id, ebi);
+    }
 
-        Assert (fs::exists(path), "what");
-        expr_path idx = -1;
-        std::string fn, fn_pre;
-        do { // find the next available file name - someone could've modified
-            idx = gen_expr_path();
-            fn = path;
-            fn.append("/");
-            fn.append(std::to_string(idx));
-            fn_pre = fn;
-            fn.append(".v");
-            fn_pre.append("pre.v");
-        } while (fs::exists(fn) || fs::exists(fn_pre));
-
-        Assert (!fs::exists(fn), "cache file already exists?");
-        Assert (!fs::exists(fn_pre), "cache file (unmapped) already exists?");
-        
-        path_map.insert({uniq_id, idx});
-        Assert (!info_map.contains(idx), "cache identifier conflict");
-        info_map.insert({idx, *ebi});
-
-        // append all contents of tmp verilog file to cache file
-        std::ifstream sourceFile(verilogfile);
-        if (!sourceFile.is_open()) {
-            std::cerr << "Error opening source file: " << verilogfile << "\n";
-            exit(1);
+    ExprBlockInfo *ret = _use_entry(uniq_id, leaves, in_expr_map);
+    if (!ret) {
+        // evicted meanwhile
+        stats.evicted++;
+        return synth_expr(targetwidth, expr, in_expr_list, in_expr_map, in_width_map);
+    }
+    _count_use(uniq_id, *count);
+    return ret;
+}
+
+ExprBlockInfo *ExprCache::synth_exprs (std::string expr_set_name,
+                                       list_t *in_expr_list,
+                                       iHashtable *in_expr_map,
+                                       iHashtable *in_width_map,
+                                       list_t *out_expr_list,
+                                       list_t *out_expr_name_list,
+                                       iHashtable *out_width_map,
+                                       list_t *hidden_expr_list,
+                                       list_t *hidden_expr_name_list)
+{
+    expr_hash uniq_id;
+    block_ports ports;
+    if (!_gen_block_id(in_expr_list, in_expr_map, in_width_map,
+                       out_expr_list, out_expr_name_list, out_width_map,
+                       hidden_expr_list, hidden_expr_name_list,
+                       &uniq_id, &ports)) {
+        // port names that cannot be made canonical; not cached
+        set_expr_outfile(_expr_file_path);
+        ExprBlockInfo *ebi = run_external_opt(expr_set_name, 
+                                in_expr_list, in_expr_map, in_width_map,
+                                out_expr_list, out_expr_name_list, out_width_map,
+                                hidden_expr_list, hidden_expr_name_list);
+        set_expr_outfile("");
+        stats.misses++;
+        stats.synth_time_us += ebi->getRuntime() + ebi->getIORuntime();
+        return ebi;
+    }
+
+    uint64_t *count = &stats.hits;
+    if (find_entry(uniq_id) || find_global(uniq_id) || find_archived(uniq_id)) {
+        auto idx = path_map.at(uniq_id);
+        Assert (info_map.contains(idx), "Could not find path to cached process.");
+    }
+    else if (!claim_entry(uniq_id)) {
+        count = &stats.waits;
+    }
+    else {
+        count = &stats.misses;
+        // synthesize the block with the canonical names
+        list_t *c_list = list_new();
+        iHashtable *c_map = ihash_new(4);
+        for ( auto e : ports.inputs ) {
+            list_append(c_list, e);
         }
-        int fd = lock_file(fn);
-        std::ofstream destFile(fn);
-        if (!destFile.is_open()) {
-            std::cerr << "Error opening dest file: " << fn << "\n";
-            exit(1);
+        ihash_iter_t iter;
+        ihash_bucket_t *ib;
+        ihash_iter_init (in_expr_map, &iter);
+        while ((ib = ihash_iter_next (in_expr_map, &iter))) {
+            auto it = ports.canon.find((char *)ib->v);
+            if (it != ports.canon.end()) {
+                ihash_add(c_map, ib->key)->v = (void *)it->second.c_str();
+            }
         }
-        rename_and_pipe(sourceFile, destFile, {}, {});
+        list_t *c_out_names = list_new();
+        for ( auto &x : ports.out_names ) {
+            list_append(c_out_names, x.c_str());
+        }
+        list_t *c_hidden_names = NULL;
+        if (hidden_expr_list) {
+            c_hidden_names = list_new();
+            for ( auto &x : ports.hidden_names ) {
+                list_append(c_hidden_names, x.c_str());
+            }
+        }
+        std::string aig = _aig_begin();
+        ExprBlockInfo *ebi = run_external_opt(module_prefix + uniq_id.hex(),
+                                c_list, c_map, in_width_map,
+                                out_expr_list, c_out_names, out_width_map,
+                                hidden_expr_list, c_hidden_names, false);
+        _aig_end(aig);
+        list_free(c_list);
+        ihash_free(c_map);
+        list_free(c_out_names);
+        list_free(c_hidden_names);
+        _publish_entry(uniq_id, ebi);
+    }
 
-        std::ifstream sourceFile2(presynfile);
-        if (!sourceFile2.is_open()) {
-            std::cerr << "Error opening source file: " << presynfile << "\n";
-            exit(1);
+    std::vector<std::string> sfinds = ports.finds;
+    std::vector<std::string> sreplaces = ports.replaces;
+    sfinds.push_back(module_prefix + uniq_id.hex());
+    sreplaces.push_back(expr_set_name);
+    ExprHasher h;
+    h.add(&uniq_id, sizeof(uniq_id));
+    for ( auto &x : sreplaces ) {
+        h.add(x);
+    }
+    ExprBlockInfo *ret = _emit_entry(uniq_id, h.value(), expr_set_name, sfinds, sreplaces);
+    if (!ret) {
+        // evicted meanwhile
+        stats.evicted++;
+        return synth_exprs(expr_set_name, in_expr_list, in_expr_map, in_width_map,
+                           out_expr_list, out_expr_name_list, out_width_map,
+                           hidden_expr_list, hidden_expr_name_list);
+    }
+    _count_use(uniq_id, *count);
+    return ret;
+}
+
+ExprBlockInfo *ExprCache::synth_exprs (std::string expr_set_name,
+                                       list_t *in_expr_list,
+                                       iHashtable *in_expr_map,
+                                       iHashtable *in_width_map,
+                                       list_t *out_expr_list,
+                                       iHashtable *out_expr_map,
+                                       iHashtable *out_width_map,
+                                       list_t *hidden_expr_list)
+{
+    list_t *out_name_list = list_new();
+    list_t *hidden_name_list = NULL;
+    listitem_t *li;
+    if (hidden_expr_list) {
+        hidden_name_list = list_new();
+        for (li = list_first(hidden_expr_list); li; li = list_next(li)) {
+            auto b = ihash_lookup(out_expr_map, (long)list_value(li));
+            Assert (b, "variable not found in variable map");
+            list_append(hidden_name_list, b->v);
         }
-        int fd2 = lock_file(fn_pre);
-        std::ofstream destFile2(fn_pre);
-        if (!destFile2.is_open()) {
-            std::cerr << "Error opening dest file: " << fn_pre << "\n";
-            exit(1);
+    }
+    for (li = list_first(out_expr_list); li; li = list_next(li)) {
+        auto b = ihash_lookup(out_expr_map, (long)list_value(li));
+        Assert (b, "variable not found in variable map");
+        list_append(out_name_list, b->v);
+    }
+    ExprBlockInfo *ebi = synth_exprs(expr_set_name, in_expr_list, in_expr_map, in_width_map,
+                                     out_expr_list, out_name_list, out_width_map,
+                                     hidden_expr_list, hidden_name_list);
+    list_free(out_name_list);
+    list_free(hidden_name_list);
+    return ebi;
+}
+
+/*
+    Before a miss is synthesized (with the key of aig_key): start from
+    its stored AIG if there is one, or else have the optimized AIG
+    saved. Returns the name the saved AIG gets, or "".
+*/
+std::string ExprCache::_aig_begin ()
+{
+    __syn.aig_in = "";
+    __syn.aig_out = "";
+    if (aig_path.empty()) {
+        return "";
+    }
+    std::string fn = aig_path + "/" + key_path(aig_key) + ".aig";
+    if (fs::exists(fn)) {
+        __syn.aig_in = fn;
+        stats.remapped++;
+        return "";
+    }
+    std::error_code ec;
+    fs::create_directories(fs::path(fn).parent_path(), ec);
+    __syn.aig_out = fn + ".tmp." + std::to_string(getpid());
+    return fn;
+}
+
+/*
+    After the miss: the saved AIG is renamed into place, so that
+    other processes only ever see a complete one.
+*/
+void ExprCache::_aig_end (const std::string &fn)
+{
+    std::string tmp = __syn.aig_out;
+    __syn.aig_in = "";
+    __syn.aig_out = "";
+    if (fn.empty()) {
+        return;
+    }
+    int fd = open(tmp.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    fdatasync(fd);
+    close(fd);
+    chmod(tmp.c_str(), 0664);
+    if (rename(tmp.c_str(), fn.c_str()) == -1) {
+        unlink(tmp.c_str());
+    }
+}
+
+/*
+    Add a newly synthesized entry: it is usable from memory right
+    away, and handed to the writer thread to be stored. Takes
+    ownership of ebi.
+*/
+void ExprCache::_publish_entry (const expr_hash &uniq_id, ExprBlockInfo *ebi)
+{
+    ebi->setID(uniq_id.hex());
+    expr_path loc = key_path(uniq_id);
+    std::string fn = entry_file(loc);
+    fs::create_directories(fs::path(fn).parent_path());
+
+    // the caller needs the defproc before the writer has stored the
+    // netlist, so it is made from the working copy
+    if (!_expr_file_path.empty()) {
+        _make_act(ebi->getMappedFile(), fn + "_" + act_tag + ".act");
+    }
+
+    // the working files are removed by cleanup_tmp_files; the writer
+    // gets links to them next to their final names (copies, if the
+    // cache is on another file system)
+    write_job job;
+    job.key = uniq_id;
+    std::string src[2] = { ebi->getMappedFile(), ebi->getUnmappedFile() };
+    job.dst[0] = fn + ".v";
+    job.dst[1] = fn + "pre.v";
+    for (int i=0; i<2; i++) {
+        job.tmp[i] = job.dst[i] + ".tmp." + std::to_string(getpid());
+        unlink(job.tmp[i].c_str());
+        if (link(src[i].c_str(), job.tmp[i].c_str()) == -1) {
+            copy_file(src[i], job.tmp[i], false);
+            stats.bytes_copied += fs::file_size(job.tmp[i]);
         }
-        rename_and_pipe(sourceFile2, destFile2, {}, {});
-        fs::permissions(fn    , fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read | fs::perms::group_write, fs::perm_options::add);
-        fs::permissions(fn_pre, fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read | fs::perms::group_write, fs::perm_options::add);
-        unlock_file(fd);
-        unlock_file(fd2);
+    }
+
+    path_map.insert({uniq_id, loc});
+    info_map.insert({loc, *ebi});
+    unread_entries.insert({uniq_id, *ebi});
+    job.index_lines = _format_index_lines({uniq_id}, &job.key_lines);
+    wrote_index = true;
+    delete ebi;
+    cleanup_tmp_files();
+
+    std::lock_guard<std::mutex> lk(writer_mu);
+    if (!writer.joinable()) {
+        writer = std::thread(&ExprCache::_writer_loop, this);
+    }
+    write_pending.insert(uniq_id);
+    write_queue.push_back(std::move(job));
+    writer_cv.notify_all();
+}
+
+/*
+    The writer thread; it takes whatever is queued, so that the index
+    lines of several entries go in with one write.
+*/
+void ExprCache::_writer_loop ()
+{
+    std::unique_lock<std::mutex> lk(writer_mu);
+    while (true) {
+        writer_cv.wait(lk, [&] { return writer_exit || !write_queue.empty(); });
+        if (write_queue.empty()) {
+            return;
+        }
+        std::vector<write_job> jobs(std::make_move_iterator(write_queue.begin()),
+                                    std::make_move_iterator(write_queue.end()));
+        write_queue.clear();
+        lk.unlock();
+        _write_entries(jobs);
+        lk.lock();
+        for ( auto &job : jobs ) {
+            write_pending.erase(job.key);
+        }
+        writer_cv.notify_all();
+    }
+}
 
-        cleanup_tmp_files();
-        unlock_file(idx_fd);
-        // write_cache_index_line (uniq_id);
+/*
+    Runs in the writer thread; it only uses the files and the names
+    of the cache, not the in-memory state of the main thread. The
+    netlists are synced before their names are linked, and the index
+    line is written only when both are in place, so readers never see
+    an incomplete entry, and a crash at any
+    point leaves at most unreferenced files (removed by a gc). An
+    entry that another process has added meanwhile gets a second
+    index line; the first one wins. Where the lines went is handed
+    back to the main thread (write_done), so that it need not parse
+    them again.
+*/
+void ExprCache::_write_entries (std::vector<write_job> &jobs)
+{
+    for ( auto &job : jobs ) {
+        for (int i=0; i<2; i++) {
+            int fd = open(job.tmp[i].c_str(), O_RDONLY);
+            if (fd != -1) {
+                fdatasync(fd);
+                close(fd);
+            }
+            chmod(job.tmp[i].c_str(), 0664);
+        }
     }
 
-    if (!(runtime_accessed_set.contains(uniq_id)) && !(_expr_file_path.empty()))
+    int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX) == -1) {
+        std::cerr << "Failed to lock " << lock_path << "\n";
+    }
+    std::string lines, keys;
+    write_span span;
+    for ( auto &job : jobs ) {
+        bool ok = (lock_fd != -1);
+        for (int i=0; i<2; i++) {
+            ok = ok && (link(job.tmp[i].c_str(), job.dst[i].c_str()) == 0 || errno == EEXIST);
+            unlink(job.tmp[i].c_str());
+        }
+        if (ok) {
+            lines.append(job.index_lines);
+            keys.append(job.key_lines);
+            span.keys.push_back(job.key);
+        }
+        else {
+            std::cerr << "Error storing cache entry: " << job.dst[0] << "\n";
+        }
+    }
+    if (!lines.empty()) {
+        int idx_fd = open(index_file.c_str(), O_RDWR | O_APPEND);
+        off_t end = (idx_fd == -1) ? -1 : lseek(idx_fd, 0, SEEK_END);
+        if (end == -1 || write(idx_fd, lines.c_str(), lines.size()) != (ssize_t)lines.size()) {
+            std::cerr << "Failed to append to " << index_file << "\n";
+        }
+        else {
+            // the first line tells which index the offset is in
+            char buf[256];
+            ssize_t n = pread(idx_fd, buf, sizeof(buf), 0);
+            span.stamp.assign(buf, (n > 0) ? n : 0);
+            span.stamp.resize(std::min(span.stamp.find('\n'), span.stamp.size()));
+            span.off = end;
+            span.len = lines.size();
+            std::lock_guard<std::mutex> lk(writer_mu);
+            write_done.push_back(std::move(span));
+        }
+        if (idx_fd != -1) {
+            close(idx_fd);
+        }
+    }
+    if (lock_fd != -1) {
+        flock(lock_fd, LOCK_UN);
+        close(lock_fd);
+    }
+    if (!keys.empty()) {
+        std::ofstream keys_file (path + std::string("/expr.keys"), std::ios::app);
+        keys_file << keys;
+    }
+
+    // processes waiting for these entries can now find them
+    for ( auto &job : jobs ) {
+        release_entry(job.key);
+    }
+}
+
+bool ExprCache::_is_pending (const expr_hash &uniq_id)
+{
+    std::lock_guard<std::mutex> lk(writer_mu);
+    return write_pending.contains(uniq_id);
+}
+
+void ExprCache::flush ()
+{
+    std::unique_lock<std::mutex> lk(writer_mu);
+    writer_cv.wait(lk, [&] { return write_pending.empty(); });
+}
+
+/*
+    Translate a netlist to the ACT defproc act_fn, through a
+    temporary file so that act_fn is always complete. Nothing is
+    locked: processes that translate the same netlist at the same
+    time make the same file, and the last rename wins.
+*/
+void ExprCache::_make_act (const std::string &netlist, const std::string &act_fn)
+{
+    std::string tmp_act = act_fn + ".tmp." + std::to_string(getpid());
+    set_expr_outfile(tmp_act);
+    run_v2act(netlist, use_tie_cells);
+    set_expr_outfile("");
+    fs::permissions(tmp_act, fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read | fs::perms::group_write, fs::perm_options::add);
+    fs::rename(tmp_act, act_fn);
+}
+
+
+/*
+    Count a use of an entry in one of the hits/waits/misses counters,
+    and its stored synthesis time as spent (misses) or saved.
+*/
+void ExprCache::_count_use (const expr_hash &uniq_id, uint64_t &count)
+{
+    ExprBlockInfo &eb = info_map.at(path_map.at(uniq_id));
+    count++;
+    if (&count == &stats.misses) {
+        stats.synth_time_us += eb.getRuntime() + eb.getIORuntime();
+    }
+    else {
+        stats.time_saved_us += eb.getRuntime() + eb.getIORuntime();
+    }
+}
+
+void ExprCache::write_stats (const std::string &fn)
+{
+    std::ofstream out(fn);
+    if (!out.is_open()) {
+        std::cerr << "Warning: could not write cache statistics to " << fn << "\n";
+        return;
+    }
+    uint64_t lookups = stats.hits + stats.waits + stats.misses;
+    out << "{\n";
+    out << "  \"cache\": \"" << path << "\",\n";
+    out << "  \"hits\": " << stats.hits << ",\n";
+    out << "  \"misses\": " << stats.misses << ",\n";
+    out << "  \"waits\": " << stats.waits << ",\n";
+    out << "  \"evicted\": " << stats.evicted << ",\n";
+    out << "  \"promoted\": " << stats.promoted << ",\n";
+    out << "  \"remapped\": " << stats.remapped << ",\n";
+    out << "  \"queried\": " << stats.queried << ",\n";
+    out << "  \"hit_rate\": " << (lookups ? (double)(stats.hits + stats.waits) / lookups : 0.0) << ",\n";
+    out << "  \"lock_wait_us\": " << stats.lock_wait_us << ",\n";
+    out << "  \"marker_wait_us\": " << stats.marker_wait_us << ",\n";
+    out << "  \"bytes_copied\": " << stats.bytes_copied << ",\n";
+    out << "  \"time_saved_us\": " << stats.time_saved_us << ",\n";
+    out << "  \"synth_time_us\": " << stats.synth_time_us << "\n";
+    out << "}\n";
+}
+
+/*
+    Resolve the keys of a set of expressions with one read of the 
+    index. keys[i] and leaves[i] are set as by _gen_unique_id, and
+    found[i] tells if the entry is in the cache.
+*/
+void ExprCache::_resolve_batch (const std::vector<expr_cache_query> &qs,
+                                std::vector<expr_hash> &keys,
+                                std::vector<std::vector<Expr *>> &leaves,
+                                std::vector<bool> &found)
+{
+    keys.resize(qs.size());
+    leaves.resize(qs.size());
+    found.assign(qs.size(), false);
+    for (size_t i=0; i<qs.size(); i++) {
+        keys[i] = _gen_unique_id(qs[i].expr, qs[i].in_expr_map, qs[i].in_width_map, 
+                                    qs[i].targetwidth, &leaves[i]);
+    }
+
+    read_cache();
+    for (size_t i=0; i<qs.size(); i++) {
+        found[i] = find_entry(keys[i]) || find_global(keys[i]) || find_archived(keys[i]);
+    }
+}
+
+/*
+    Ask the kernel to start reading the files of the entries that are
+    in the cache, without waiting for them.
+*/
+void ExprCache::prefetch (const std::vector<expr_cache_query> &qs)
+{
+    std::vector<expr_hash> keys;
+    std::vector<std::vector<Expr *>> leaves;
+    std::vector<bool> found;
+    _resolve_batch(qs, keys, leaves, found);
+    _prefetch_entries(keys, found);
+}
+
+void ExprCache::_prefetch_entries (const std::vector<expr_hash> &keys,
+                                   const std::vector<bool> &found)
+{
+    for (size_t i=0; i<keys.size(); i++) {
+        if (!found[i]) {
+            continue;
+        }
+        std::string fn = entry_file(path_map.at(keys[i]));
+        // the defproc if it has been translated, else the netlist
+        int fd = open((fn + "_" + act_tag + ".act").c_str(), O_RDONLY);
+        if (fd == -1) {
+            fd = open((fn + ".v").c_str(), O_RDONLY);
+        }
+        if (fd != -1) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    }
+}
+
+std::vector<int> ExprCache::lookup_batch (const std::vector<expr_cache_query> &qs,
+                                          std::vector<ExprBlockInfo *> &results)
+{
+    std::vector<expr_hash> keys;
+    std::vector<std::vector<Expr *>> leaves;
+    std::vector<bool> found;
+    _resolve_batch(qs, keys, leaves, found);
+    _prefetch_entries(keys, found);
+
+    std::vector<int> misses = {};
+    results.assign(qs.size(), NULL);
+    for (size_t i=0; i<qs.size(); i++) {
+        if (found[i]) {
+            results[i] = _use_entry(keys[i], leaves[i], qs[i].in_expr_map);
+            if (results[i]) {
+                _count_use(keys[i], stats.hits);
+            }
+            else {
+                stats.evicted++;
+            }
+        }
+        if (!results[i]) {
+            misses.push_back(i);
+        }
+    }
+    return misses;
+}
+
+expr_hash ExprCache::expr_key (int targetwidth, Expr *expr,
+                               iHashtable *in_expr_map, iHashtable *in_width_map)
+{
+    return _gen_unique_id(expr, in_expr_map, in_width_map, targetwidth, NULL);
+}
+
+bool ExprCache::query_metrics (int targetwidth, Expr *expr, list_t *in_expr_list,
+                               iHashtable *in_expr_map, iHashtable *in_width_map,
+                               expr_cache_record *rec, bool synth)
+{
+    expr_hash uniq_id = expr_key(targetwidth, expr, in_expr_map, in_width_map);
+    if (query_metrics(uniq_id, rec)) {
+        return true;
+    }
+    // entries made before function keys have the structural key, as
+    // in synth_expr
+    expr_hash s_id = uniq_id;
+    if (key_functional) {
+        s_id = _gen_unique_id(expr, in_expr_map, in_width_map, targetwidth, NULL, false);
+        if (query_metrics(s_id, rec)) {
+            return true;
+        }
+    }
+    if (!synth) {
+        return false;
+    }
+    std::string expr_file = _expr_file_path;
+    _expr_file_path = "";
+    delete synth_expr(targetwidth, expr, in_expr_list, in_expr_map, in_width_map);
+    _expr_file_path = expr_file;
+    return query_metrics(uniq_id, rec) || (s_id != uniq_id && query_metrics(s_id, rec));
+}
+
+/*
+    Tiers are tried in lookup order; unlike find_entry and friends,
+    nothing is added to the maps (which would allocate), and uses are
+    not counted in the access log.
+*/
+bool ExprCache::query_metrics (const expr_hash &uniq_id, expr_cache_record *rec)
+{
+    auto it = path_map.find(uniq_id);
+    if (it != path_map.end()) {
+        auto ib = info_map.find(it->second);
+        Assert (ib != info_map.end(), "Expr block info not found");
+        ExprBlockInfo &eb = ib->second;
+        metric_triplet m[4] = { eb.getDelay(), eb.getPower(), 
+                                eb.getStaticPower(), eb.getDynamicPower() };
+        *rec = expr_cache_record{uniq_id.hi, uniq_id.lo, -1};
+        for (int i=0; i<4; i++) {
+            rec->metrics[3*i] = m[i].min_val;
+            rec->metrics[3*i+1] = m[i].typ_val;
+            rec->metrics[3*i+2] = m[i].max_val;
+        }
+        rec->area = eb.getArea();
+        rec->mapper_runtime = eb.getRuntime();
+        rec->io_runtime = eb.getIORuntime();
+    }
+    else if (!bindex.lookup(uniq_id, rec) && !global_bindex.lookup(uniq_id, rec)) {
+        auto gt = global_tail.find(uniq_id);
+        int64_t i;
+        if (gt != global_tail.end()) {
+            *rec = gt->second;
+        }
+        else if ((i = archive ? archive->lookup(uniq_id) : -1) >= 0) {
+            *rec = archive->record(i);
+        }
+        else {
+            return false;
+        }
+    }
+    stats.queried++;
+    return true;
+}
+
+/*
+    Use an entry that is in the cache: append its defproc (renamed for
+    the port order of the caller) to the expr file the first time, and
+    return its info. Returns NULL if the entry has been evicted.
+*/
+ExprBlockInfo *ExprCache::_use_entry (const expr_hash &uniq_id,
+                                      const std::vector<Expr *> &leaves,
+                                      iHashtable *in_expr_map)
+{
+    // the cached block has canonical port names; if the caller numbers
+    // its inputs differently, it gets a renamed copy of the block
+    std::vector<std::string> sfinds = {};
+    std::vector<std::string> sreplaces = {};
+    for (size_t i=0; i<leaves.size(); i++) {
+        int port = ihash_lookup(in_expr_map, (long)leaves[i])->i;
+        if (port != (int)i) {
+            sfinds.push_back(expr_prefix + std::to_string(i));
+            sreplaces.push_back(expr_prefix + std::to_string(port));
+        }
+    }
+    expr_hash inst_id = uniq_id;
+    std::string blk_id = uniq_id.hex();
+    if (!sfinds.empty()) {
+        ExprHasher h;
+        h.add(&uniq_id, sizeof(uniq_id));
+        for ( auto &x : sreplaces ) {
+            h.add(x);
+        }
+        inst_id = h.value();
+        blk_id.append("_" + inst_id.hex().substr(0, 8));
+        sfinds.push_back(module_prefix + uniq_id.hex());
+        sreplaces.push_back(module_prefix + blk_id);
+    }
+    return _emit_entry(uniq_id, inst_id, blk_id, sfinds, sreplaces);
+}
+
+/*
+    Append the defproc of an entry to the output file, renamed with
+    sfinds/sreplaces, unless instance inst_id is there already.
+    Returns a copy of the entry's info with ID blk_id, or NULL if the
+    entry was evicted.
+*/
+ExprBlockInfo *ExprCache::_emit_entry (const expr_hash &uniq_id,
+                                       const expr_hash &inst_id,
+                                       const std::string &blk_id,
+                                       const std::vector<std::string> &sfinds,
+                                       const std::vector<std::string> &sreplaces)
+{
+    if (!(runtime_accessed_set.contains(inst_id)) && !(_expr_file_path.empty()))
     {
-        // for ( auto x : runtime_accessed_set ) {
-        // fprintf (stdout, "\nMember: %s\n", x.c_str());
-        // }
-        // fprintf (stdout, "\nID: %s\n", uniq_id.c_str());
-        // read the cached defproc
+        // the translated defproc is cached next to the netlist, one
+        // per output configuration; v2act only runs the first time
         Assert (fs::exists(path), "what");
-        std::string fn = path;
-        fn.append("/");
-        fn.append(std::to_string(path_map.at(uniq_id)));
-        std::string fn_pre = fn;
+        std::string fn = entry_file(path_map.at(uniq_id));
+        std::string act_fn = fn + "_" + act_tag + ".act";
         fn.append(".v");
-        fn_pre.append("pre.v");
 
-        // append all contents of reqd. cache file to output expr file
-        int fd = lock_file(fn);
-        std::ifstream sourceFile(fn);
-        if (!sourceFile.is_open()) {
-            std::cerr << "Error opening source file: " << fn << "\n";
-            exit(1);
+        if (!fs::exists(fn) && !_is_pending(uniq_id)) {
+            // evicted since we looked it up; if a gc compacted the
+            // index, re-reading it drops the entry
+            read_cache();
+            if (find_entry(uniq_id)) {
+                std::cerr << "Error: cache entry without netlist: " << fn << "\n";
+                exit(1);
+            }
+            return NULL;
         }
-        std::ofstream destFile(_expr_file_path, std::ios::app);
-        if (!destFile.is_open()) {
-            std::cerr << "Error opening dest file: " << _expr_file_path << "\n";
-            exit(1);
+
+        if (!fs::exists(act_fn)) {
+            _make_act(fn, act_fn);
         }
 
-        std::chrono::microseconds dummy;
-        set_expr_outfile(_expr_file_path);
-        backend(fn, fn_pre, dummy, dummy);
-        set_expr_outfile("");
-        unlock_file(fd);
-        runtime_accessed_set.insert(uniq_id);
+        // append the defproc to the output expr file
+        rename_and_pipe(act_fn, _expr_file_path, sfinds, sreplaces);
+        stats.bytes_copied += fs::file_size(act_fn);
+        runtime_accessed_set.insert(inst_id);
     }
 
-    dump_at_exit.insert(uniq_id);
+    access_counts[uniq_id]++;
 
     ExprBlockInfo eb = info_map.at(path_map.at(uniq_id));
     ExprBlockInfo *ebi = new ExprBlockInfo(eb);
+    ebi->setID(blk_id);
     return ebi;
 }
 
+/*
+    Store data in the cache under its final name. It is written to
+    a temporary file first, and then linked to the final name, which
+    fails if the name exists; an existing file is complete, and has
+    the same contents, so it is kept.
+*/
+void ExprCache::store_data (std::string_view data, const std::string &dst)
+{
+    std::string tmp = dst + ".tmp." + std::to_string(getpid());
+    std::ofstream destFile(tmp, std::ios::binary);
+    if (!destFile.is_open()) {
+        std::cerr << "Error opening dest file: " << tmp << "\n";
+        exit(1);
+    }
+    destFile.write(data.data(), data.size());
+    destFile.close();
+    _link_tmp(tmp, dst);
+}
+
+void ExprCache::_link_tmp (const std::string &tmp, const std::string &dst)
+{
+    stats.bytes_copied += fs::file_size(tmp);
+    fs::permissions(tmp, fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read | fs::perms::group_write, fs::perm_options::add);
+    if (link(tmp.c_str(), dst.c_str()) == -1 && errno != EEXIST) {
+        std::cerr << "Error storing cache file: " << dst << "\n";
+        exit(1);
+    }
+    unlink(tmp.c_str());
+}
+
 void ExprCache::v2act_and_pipe (std::ifstream &src, 
                                  std::ofstream &dst)
 {
 }
 
-void ExprCache::rename_and_pipe (std::ifstream &src, 
-                                 std::ofstream &dst,
-                                 const std::vector<std::string> sfinds,
-                                 const std::vector<std::string> sreplaces)
+/*
+    Copy the contents of one file descriptor to another, from and at
+    their current offsets, in the kernel if possible: copy_file_range
+    (which can share blocks on some file systems), then sendfile, then
+    read/write for file systems that support neither.
+*/
+static bool copy_fd (int in, int out)
 {
-    std::string line;
-    while (std::getline(src, line)) 
-    {
-        for ( int i=0; i<sfinds.size(); i++ ) {
-            std::size_t pos = 0;
-            auto sfind = sfinds.at(i);
-            auto sreplace = sreplaces.at(i);
-            while ((pos = line.find(sfind, pos)) != std::string::npos) 
-            {
-                line.replace(pos, sfind.size(), sreplace);
-                pos += sreplace.size();
+    ssize_t n;
+#if defined(__linux__)
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0) ;
+    if (n == 0) {
+        return true;
+    }
+    if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+        return false;
+    }
+    while ((n = sendfile(out, in, NULL, 1 << 30)) > 0) ;
+    if (n == 0) {
+        return true;
+    }
+    if (errno != ENOSYS && errno != EINVAL) {
+        return false;
+    }
+#endif
+    char buf[1 << 16];
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        for (ssize_t w = 0, k; w < n; w += k) {
+            if ((k = write(out, buf + w, n - w)) <= 0) {
+                return false;
             }
         }
-        dst << line << "\n";
     }
+    return n == 0;
 }
 
-void ExprCache::read_cache_unlocked()
+/*
+    Copy src to dst, or append it to dst. A new file is made a reflink
+    of src where the file system supports it.
+*/
+void ExprCache::copy_file (const std::string &src, const std::string &dst, bool append)
 {
-    std::ifstream idx_file(index_file);
+    int in = open(src.c_str(), O_RDONLY);
+    if (in == -1) {
+        std::cerr << "Error opening source file: " << src << "\n";
+        exit(1);
+    }
+    // not O_APPEND: the kernel copies refuse it. This process is the
+    // only writer of the file.
+    int out = open(dst.c_str(), O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC), 0666);
+    if (out == -1 || (append && lseek(out, 0, SEEK_END) == -1)) {
+        std::cerr << "Error opening dest file: " << dst << "\n";
+        exit(1);
+    }
+    bool ok = false;
+#ifdef FICLONE
+    ok = !append && ioctl(out, FICLONE, in) == 0;
+#endif
+    if (!ok && !copy_fd(in, out)) {
+        std::cerr << "Error copying " << src << " to " << dst << "\n";
+        exit(1);
+    }
+    close(in);
+    if (close(out) == -1) {
+        std::cerr << "Error writing dest file: " << dst << "\n";
+        exit(1);
+    }
+}
+
+/*
+    Append src to dst, replacing every identifier that is in sfinds
+    with the corresponding entry of sreplaces. Only whole identifiers
+    are replaced, and all replacements are done in a single pass, so
+    that swapping names (in_0 <-> in_1) works. Without replacements,
+    this is a plain copy_file.
+*/
+void ExprCache::rename_and_pipe (const std::string &src, 
+                                 const std::string &dst,
+                                 const std::vector<std::string> &sfinds,
+                                 const std::vector<std::string> &sreplaces)
+{
+    if (sfinds.empty()) {
+        copy_file(src, dst, true);
+        return;
+    }
+    std::unordered_map<std::string_view, std::string_view> rmap = {};
+    for ( size_t i=0; i<sfinds.size(); i++ ) {
+        rmap.insert({sfinds.at(i), sreplaces.at(i)});
+    }
+
+    int in = open(src.c_str(), O_RDONLY);
+    if (in == -1) {
+        std::cerr << "Error opening source file: " << src << "\n";
+        exit(1);
+    }
+    int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (out == -1) {
+        std::cerr << "Error opening dest file: " << dst << "\n";
+        exit(1);
+    }
+
+    // the file is read in blocks, and each block is rewritten up to
+    // its last complete line; identifiers do not span lines
+    const size_t blk = 1 << 16;
+    std::string buf, res;
+    bool ok = true;
+    bool eof = false;
+    while (ok && !eof) {
+        size_t have = buf.size();
+        buf.resize(have + blk);
+        ssize_t n = read(in, buf.data() + have, blk);
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        buf.resize(have + n);
+        eof = (n == 0);
+        size_t end = eof ? buf.size() : buf.rfind('\n', buf.size()) + 1;
+        if (!eof && end == 0) {
+            continue;
+        }
+
+        res.clear();
+        expr_cache_rename_ids(std::string_view(buf.data(), end), rmap, &res);
+        ok = write(out, res.data(), res.size()) == (ssize_t)res.size();
+        buf.erase(0, end);
+    }
+    close(in);
+    if (close(out) == -1 || !ok) {
+        std::cerr << "Error copying " << src << " to " << dst << "\n";
+        exit(1);
+    }
+}
+
+/*
+    Read the records added to the index since the last call, and add
+    them to the maps. No lock is needed: records are appended as whole
+    lines (an incomplete last line is left for the next call),
+    snapshots are renamed into place, and a gc replaces the index by
+    a rename, with a new first line.
+*/
+void ExprCache::read_cache()
+{
+    std::ifstream idx_file(index_file, std::ios::binary);
     if (!idx_file.is_open()) {
         std::cerr << "Error: Could not open cache index file (" << index_file << ") for reading.\n";
         exit(1);
     }
 
+    // first read, or the index was replaced: start over. The
+    // snapshot covers a prefix of the journal; only the records
+    // appended after it need to be parsed
+    idx_file.seekg(0, std::ios::end);
+    uint64_t size = idx_file.tellg();
+    idx_file.seekg(0);
+    std::string stamp;
+    std::getline(idx_file, stamp);
+    if (journal_pos == 0 || size < journal_pos || stamp != index_stamp) {
+        index_stamp = stamp;
+        path_map.clear();
+        info_map.clear();
+        journal_tail.clear();
+        if (bindex.open(bindex_file) && 
+            (bindex.journal_offset() > size || 
+             bindex.stamp() != expr_cache_journal_stamp(stamp))) {
+            bindex.close(); // stale snapshot, or one of another index
+        }
+        journal_pos = bindex.journal_offset();
+        // new entries are used from memory until their lines are read
+        for ( auto &x : unread_entries ) {
+            expr_path loc = key_path(x.first);
+            path_map.insert({x.first, loc});
+            info_map.insert({loc, x.second});
+        }
+    }
+    _take_write_spans();
+    idx_file.clear();
+    idx_file.seekg(journal_pos);
+
     std::string line;
     while (std::getline(idx_file, line)) {
-        std::istringstream ss(line);
-        if (line.at(0)=='#') {
+        if (idx_file.eof()) {
+            break; // incomplete last line
+        }
+        journal_pos += line.size() + 1;
+        if (line.empty() || line.at(0)=='#') {
             continue; // comment
         }
-        read_cache_index_line(line);
-        cache_counter++;
+        expr_hash key;
+        if (read_cache_index_line(line, &key)) {
+            journal_tail.push_back(key);
+        }
     }
 }
 
-void ExprCache::read_cache()
+/*
+    Write the number of uses of every entry since the last call to a
+    new access log segment of its own, for eviction. No lock is
+    needed; gc merges the segments.
+*/
+void ExprCache::write_access_log ()
 {
-    int fd = lock_file(index_file);
-    read_cache_unlocked();
-    unlock_file(fd);
+    if (access_counts.empty()) {
+        return;
+    }
+    std::ostringstream buf;
+    long now = time(NULL);
+    for ( auto &x : access_counts ) {
+        buf << x.first.hex() << idx_file_delimiter << x.second << idx_file_delimiter << now << "\n";
+    }
+    std::string out = buf.str();
+    char host[256];
+    if (gethostname(host, sizeof(host)) == -1) {
+        strcpy(host, "unknown");
+    }
+    host[sizeof(host)-1] = '\0';
+    std::string fn = path + "/" + expr_cache_access_name + "." + std::to_string(now) 
+                        + "." + host + "." + std::to_string(getpid());
+    std::string tmp = fn + ".tmp." + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0664);
+    bool ok = fd != -1 && write(fd, out.c_str(), out.size()) == (ssize_t)out.size();
+    if (fd != -1) {
+        close(fd);
+    }
+    if (!ok || rename(tmp.c_str(), fn.c_str()) == -1) {
+        std::cerr << "Warning: failed to write " << fn << "\n";
+        unlink(tmp.c_str());
+    }
+    access_counts.clear();
+}
+
+/*
+    Look up an id, first in the maps and then in the snapshot.
+    Snapshot entries are copied into the maps when found.
+*/
+bool ExprCache::find_entry (const expr_hash &uniq_id)
+{
+    if (path_map.contains(uniq_id)) {
+        return true;
+    }
+    expr_cache_record r;
+    if (!bindex.lookup(uniq_id, &r)) {
+        return false;
+    }
+    _add_record(r);
+    return true;
+}
+
+/*
+    Look up an id in the read-only archive. An entry found there is 
+    copied into the cache, so that it can be used like any other.
+*/
+bool ExprCache::find_archived (const expr_hash &uniq_id)
+{
+    int64_t i = archive ? archive->lookup(uniq_id) : -1;
+    if (i < 0) {
+        return false;
+    }
+    expr_path loc = key_path(uniq_id);
+    std::string fn = entry_file(loc);
+    fs::create_directories(fs::path(fn).parent_path());
+    store_data(archive->netlist(i, false), fn + ".v");
+    store_data(archive->netlist(i, true), fn + "pre.v");
+    _promote(archive->record(i));
+    return true;
+}
+
+/*
+    Read the index of the global tier: its snapshot, and the journal
+    records after it. Nothing is locked; whole lines are appended to
+    the journal, and an incomplete last line is skipped.
+*/
+void ExprCache::read_global ()
+{
+    std::string gidx = global_path + "/" + expr_cache_index_name;
+    std::ifstream idx_file(gidx, std::ios::binary);
+    if (!idx_file.is_open()) {
+        return;
+    }
+    idx_file.seekg(0, std::ios::end);
+    uint64_t size = idx_file.tellg();
+    idx_file.seekg(0);
+    std::string line, loc;
+    std::getline(idx_file, line);
+    if (global_bindex.open(global_path + "/" + expr_cache_bindex_name) &&
+        (global_bindex.journal_offset() > size ||
+         global_bindex.stamp() != expr_cache_journal_stamp(line))) {
+        global_bindex.close(); // stale snapshot, or one of another index
+    }
+    idx_file.clear();
+    idx_file.seekg(global_bindex.journal_offset());
+    expr_cache_record rec;
+    while (std::getline(idx_file, line)) {
+        if (idx_file.eof()) {
+            break;
+        }
+        if (expr_cache_parse_line(line, &rec, &loc) && !global_tail.contains(rec.key())) {
+            rec.loc = loc.find('/') == std::string::npos ? std::stoll(loc) : -1;
+            global_tail.insert({rec.key(), rec});
+        }
+    }
 }
 
-void ExprCache::read_cache_index_line (std::string line) {
+/*
+    Look up an entry in the global tier; if it is there, its netlists
+    are copied into this (local) cache, so that later runs find it
+    locally.
+*/
+bool ExprCache::find_global (const expr_hash &uniq_id)
+{
+    if (global_path.empty()) {
+        return false;
+    }
+    expr_cache_record rec;
+    if (!global_bindex.lookup(uniq_id, &rec)) {
+        auto it = global_tail.find(uniq_id);
+        if (it == global_tail.end()) {
+            return false;
+        }
+        rec = it->second;
+    }
+    std::string src = global_path + "/" + 
+                        ((rec.loc >= 0) ? std::to_string(rec.loc) : key_path(uniq_id));
+    if (!fs::exists(src + ".v") || !fs::exists(src + "pre.v")) {
+        return false; // evicted from the global tier
+    }
+    std::string fn = entry_file(key_path(uniq_id));
+    fs::create_directories(fs::path(fn).parent_path());
+    std::string pid = std::to_string(getpid());
+    copy_file(src + ".v", fn + ".v.tmp." + pid, false);
+    _link_tmp(fn + ".v.tmp." + pid, fn + ".v");
+    copy_file(src + "pre.v", fn + "pre.v.tmp." + pid, false);
+    _link_tmp(fn + "pre.v.tmp." + pid, fn + "pre.v");
+    rec.loc = -1;
+    _promote(rec);
+    stats.promoted++;
+    return true;
+}
+
+/*
+    Add the record of an entry whose files have just been stored,
+    unless another process has added it meanwhile.
+*/
+void ExprCache::_promote (const expr_cache_record &rec)
+{
+    int lock_fd = lock_file(lock_path);
+    read_cache();
+    if (!find_entry(rec.key())) {
+        _add_record(rec);
+        write_cache_index_lines_unlocked({rec.key()});
+    }
+    unlock_file(lock_fd);
+}
+
+bool ExprCache::publish (uint64_t batch)
+{
+    if (global_path.empty()) {
+        std::cerr << "Warning: no global cache to publish to\n";
+        return false;
+    }
+    flush();
+    uint64_t added, skipped;
+    if (!expr_cache_publish(path, global_path, batch, &added, &skipped)) {
+        std::cerr << "Warning: publishing " << path << " to " << global_path << " failed\n";
+        return false;
+    }
+    return true;
+}
+
+void ExprCache::_add_record (const expr_cache_record &r)
+{
+    expr_hash uniq_id = r.key();
+    metric_triplet m[4];
+    for (int i=0; i<4; i++) {
+        m[i].set_metrics(r.metrics[3*i], r.metrics[3*i+1], r.metrics[3*i+2]);
+    }
+    // entries from before the sharded layout have a number
+    expr_path loc = (r.loc >= 0) ? std::to_string(r.loc) : key_path(uniq_id);
+    ExprBlockInfo eb (m[0], m[1], m[2], m[3], r.area, r.mapper_runtime, r.io_runtime, 
+                        loc+".v", loc+"pre.v", uniq_id.hex());
+    path_map.insert({uniq_id, loc});
+    info_map.insert({loc, eb});
+}
+
+/*
+    Write a new snapshot with the old snapshot and the journal tail.
+    Must hold the index lock.
+*/
+void ExprCache::rebuild_index_unlocked ()
+{
+    std::vector<expr_cache_record> recs = {};
+    bindex.for_each([&](const expr_cache_record &r) {
+        recs.push_back(r);
+    });
+    std::unordered_set<expr_hash> seen = {};
+    for ( auto &k : journal_tail ) {
+        expr_cache_record r;
+        if (bindex.lookup(k, &r) || !seen.insert(k).second) {
+            continue;
+        }
+        expr_path loc = path_map.at(k);
+        ExprBlockInfo eb = info_map.at(loc);
+        metric_triplet m[4] = { eb.getDelay(), eb.getPower(), 
+                                eb.getStaticPower(), eb.getDynamicPower() };
+        for (int i=0; i<4; i++) {
+            r.metrics[3*i] = m[i].min_val;
+            r.metrics[3*i+1] = m[i].typ_val;
+            r.metrics[3*i+2] = m[i].max_val;
+        }
+        r.key_hi = k.hi;
+        r.key_lo = k.lo;
+        r.loc = (loc == key_path(k)) ? -1 : std::stoll(loc);
+        r.area = eb.getArea();
+        r.mapper_runtime = eb.getRuntime();
+        r.io_runtime = eb.getIORuntime();
+        recs.push_back(r);
+    }
+    if (ExprCacheIndex::write(bindex_file, recs, journal_pos, 
+                              expr_cache_journal_stamp(index_stamp))) {
+        bindex.open(bindex_file);
+        journal_tail.clear();
+    }
+}
+
+/*
+    Skip the lines the writer thread has appended right where the
+    index has been read up to; their entries are in memory already.
+    Lines with others' lines before them are parsed like any other.
+*/
+void ExprCache::_take_write_spans ()
+{
+    std::vector<write_span> spans;
+    {
+        std::lock_guard<std::mutex> lk(writer_mu);
+        spans.swap(write_done);
+    }
+    std::sort(spans.begin(), spans.end(), [](const write_span &a, const write_span &b) {
+        return a.off < b.off;
+    });
+    std::vector<write_span> later = {};
+    for ( auto &sp : spans ) {
+        if (sp.stamp == index_stamp && sp.off > journal_pos) {
+            later.push_back(std::move(sp));
+            continue;
+        }
+        if (sp.stamp == index_stamp && sp.off == journal_pos) {
+            journal_pos += sp.len;
+            for ( auto &k : sp.keys ) {
+                journal_tail.push_back(k);
+            }
+        }
+        // read already, or in an index that a gc has replaced
+        for ( auto &k : sp.keys ) {
+            unread_entries.erase(k);
+        }
+    }
+    if (!later.empty()) {
+        std::lock_guard<std::mutex> lk(writer_mu);
+        for ( auto &sp : later ) {
+            write_done.push_back(std::move(sp));
+        }
+    }
+}
+
+bool ExprCache::read_cache_index_line (std::string line, expr_hash *key) {
     std::istringstream ss(line);
 
     std::vector<std::string> tokens = {};
@@ -426,20 +2133,31 @@ void ExprCache::read_cache_index_line (std::string line) {
         tokens.push_back(token);
     }
     
-    Assert (tokens.size()==n_cols, "Malformed index file");
+    Assert (tokens.size()==(size_t)n_cols, "Malformed index file");
+
+    // entries keyed by expression strings are from an older version
+    if (!key->from_hex(tokens[0])) {
+        return false;
+    }
 
+    // an entry can have more than one line (e.g. two processes
+    // missed it at the same time, or it is this process's own new
+    // entry); the first one wins
+    if (path_map.contains(*key)) {
+        unread_entries.erase(*key);
+        return true;
+    }
     expr_path loc = to_expr_path(tokens[1]);
-    Assert (!path_map.contains(tokens[0]), "duplicate expression in cache index");
-    path_map.insert({tokens[0],loc});
+    path_map.insert({*key,loc});
 
     std::vector<metric_triplet> tmp = {};
     for (int i=0; i<n_metrics; i++) {
         metric_triplet mt;
         // min, typ, max in order
-        mt.set_metrics(std::stod(tokens[2+(i)]), std::stod(tokens[2+(i+1)]), std::stod(tokens[2+(i+2)]));
+        mt.set_metrics(std::stod(tokens[2+(3*i)]), std::stod(tokens[2+(3*i+1)]), std::stod(tokens[2+(3*i+2)]));
         tmp.push_back(mt);
     } 
-    Assert (tmp.size()==n_metrics, "Incomplete metrics");
+    Assert (tmp.size()==(size_t)n_metrics, "Incomplete metrics");
 
     metric_triplet del = tmp[0];
     metric_triplet pow = tmp[1];
@@ -450,37 +2168,78 @@ void ExprCache::read_cache_index_line (std::string line) {
     double mapper_runtime = std::stod(tokens[mapper_runtime_id]);
     double io_runtime = std::stod(tokens[io_runtime_id]);
 
-    ExprBlockInfo eb (del, pow, st_pow, dyn_pow, area, mapper_runtime, io_runtime, std::to_string(loc)+".v", std::to_string(loc)+"pre.v", tokens[0]);
+    ExprBlockInfo eb (del, pow, st_pow, dyn_pow, area, mapper_runtime, io_runtime, loc+".v", loc+"pre.v", tokens[0]);
     Assert (!info_map.contains(loc), "duplicate data in cache index file");
     info_map.insert({loc, eb});
+    return true;
 }
 
-void ExprCache::write_cache_index_line (std::string uniq_id)
+void ExprCache::write_cache_index_lines (const std::vector<expr_hash> &ids)
 {
-    int fd = lock_file(index_file);
-    write_cache_index_line_unlocked(uniq_id);
+    int fd = lock_file(lock_path);
+    read_cache();
+    write_cache_index_lines_unlocked(ids);
     unlock_file(fd);
 }
 
-void ExprCache::write_cache_index_line_unlocked (std::string uniq_id)
+/*
+    Append the index lines of a set of entries with one write. Must
+    hold the writer lock and have read the index up to its end.
+*/
+void ExprCache::write_cache_index_lines_unlocked (const std::vector<expr_hash> &ids)
 {
-    std::ofstream idx_file (index_file, std::ios::app);
+    if (ids.empty()) {
+        return;
+    }
+    std::string keys;
+    std::string out = _format_index_lines(ids, &keys);
+    for ( auto &uniq_id : ids ) {
+        journal_tail.push_back(uniq_id);
+    }
+
+    int fd = open(index_file.c_str(), O_WRONLY | O_APPEND);
+    if (fd == -1 || write(fd, out.c_str(), out.size()) != (ssize_t)out.size()) {
+        std::cerr << "Failed to append to " << index_file << "\n";
+        exit(1);
+    }
+    close(fd);
+    journal_pos += out.size();
+    wrote_index = true;
 
-    Assert (path_map.contains(uniq_id), "Expr not in cache");
-    expr_path ep = path_map.at(uniq_id);
-    Assert (info_map.contains(ep), "Expr block info not found");
-    ExprBlockInfo eb = info_map.at(ep);
+    if (!keys.empty()) {
+        std::ofstream keys_file (path + std::string("/expr.keys"), std::ios::app);
+        keys_file << keys;
+    }
+}
 
-    idx_file << uniq_id << idx_file_delimiter << ep << idx_file_delimiter;
-    idx_file << eb.getDelay().min_val << idx_file_delimiter << eb.getDelay().typ_val << idx_file_delimiter << eb.getDelay().max_val << idx_file_delimiter;
-    idx_file << eb.getPower().min_val << idx_file_delimiter << eb.getPower().typ_val << idx_file_delimiter << eb.getPower().max_val << idx_file_delimiter;
-    idx_file << eb.getStaticPower().min_val << idx_file_delimiter << eb.getStaticPower().typ_val << idx_file_delimiter << eb.getStaticPower().max_val << idx_file_delimiter;
-    idx_file << eb.getDynamicPower().min_val << idx_file_delimiter << eb.getDynamicPower().typ_val << idx_file_delimiter << eb.getDynamicPower().max_val << idx_file_delimiter;
-    idx_file << eb.getArea() << idx_file_delimiter;
-    idx_file << eb.getRuntime() << idx_file_delimiter;
-    idx_file << eb.getIORuntime();
+/*
+    The index lines of a set of entries, and their debug key lines
+    (expr.keys) in *keys.
+*/
+std::string ExprCache::_format_index_lines (const std::vector<expr_hash> &ids,
+                                            std::string *keys)
+{
+    std::ostringstream buf, keys_buf;
+    for ( auto &uniq_id : ids ) {
+        Assert (path_map.contains(uniq_id), "Expr not in cache");
+        expr_path ep = path_map.at(uniq_id);
+        Assert (info_map.contains(ep), "Expr block info not found");
+        ExprBlockInfo &eb = info_map.at(ep);
 
-    idx_file << std::endl;
+        buf << uniq_id.hex() << idx_file_delimiter << ep << idx_file_delimiter;
+        buf << eb.getDelay().min_val << idx_file_delimiter << eb.getDelay().typ_val << idx_file_delimiter << eb.getDelay().max_val << idx_file_delimiter;
+        buf << eb.getPower().min_val << idx_file_delimiter << eb.getPower().typ_val << idx_file_delimiter << eb.getPower().max_val << idx_file_delimiter;
+        buf << eb.getStaticPower().min_val << idx_file_delimiter << eb.getStaticPower().typ_val << idx_file_delimiter << eb.getStaticPower().max_val << idx_file_delimiter;
+        buf << eb.getDynamicPower().min_val << idx_file_delimiter << eb.getDynamicPower().typ_val << idx_file_delimiter << eb.getDynamicPower().max_val << idx_file_delimiter;
+        buf << eb.getArea() << idx_file_delimiter;
+        buf << eb.getRuntime() << idx_file_delimiter;
+        buf << eb.getIORuntime();
+        buf << "\n";
 
-    idx_file.close();
-}
\ No newline at end of file
+        if (debug_keys && key_strings.contains(uniq_id)) {
+            keys_buf << uniq_id.hex() << idx_file_delimiter << key_strings.at(uniq_id) << "\n";
+        }
+    }
+    *keys = keys_buf.str();
+    return buf.str();
+}
@@ -22,16 +22,56 @@
 #pragma once
 
 #include <act/expropt.h>
+#include <act/expr_cache_index.h>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 // #include "expropt.h"
 
 /*
-    Path of an expression file within the cache.
-    int -> uses an integer as filename.
+    Path of an expression file within the cache, without the
+    extension: ab/cd/<key>, or a number for entries stored before
+    the sharded layout.
 */
-typedef int expr_path;
+typedef std::string expr_path;
+
+class ExprIR;
+class ExprCacheArchive;
 
 static const std::string _tmp_expr_file = "tmp_expr.act";
 
+/*
+    One expression for the batch interface of ExprCache; the fields
+    are the arguments of synth_expr.
+*/
+struct expr_cache_query {
+    int targetwidth;
+    Expr *expr;
+    list_t *in_expr_list;
+    iHashtable *in_expr_map;
+    iHashtable *in_width_map;
+};
+
+/*
+    Statistics of one ExprCache. Times are in microseconds.
+*/
+struct expr_cache_stats {
+    uint64_t hits;              // found in the cache
+    uint64_t misses;            // synthesized
+    uint64_t waits;             // synthesized by another process meanwhile
+    uint64_t evicted;           // hits whose files were evicted before use
+    uint64_t promoted;          // hits copied from the global tier
+    uint64_t remapped;          // misses mapped from a stored AIG
+    uint64_t queried;           // answered by query_metrics
+    uint64_t lock_wait_us;      // waiting for file locks
+    uint64_t marker_wait_us;    // waiting for other processes' misses
+    uint64_t bytes_copied;      // into and out of the cache
+    uint64_t time_saved_us;     // stored synthesis time of the hits and waits
+    uint64_t synth_time_us;     // synthesis time of the misses
+};
+
 class ExprCache : public ExternalExprOpt {
 public:
 
@@ -49,11 +89,100 @@ public:
     */
     ExprBlockInfo *synth_expr (int, Expr *, list_t *, iHashtable *, iHashtable *);
 
+    /*
+        Cached version of the general C-STRING MODE run_external_opt:
+        a block of output (and hidden) expressions. The key covers all
+        of them; a hit is renamed to expr_set_name and the caller's
+        port names. Arguments are the same as run_external_opt.
+    */
+    ExprBlockInfo *synth_exprs (std::string expr_set_name,
+                                list_t *in_expr_list,
+                                iHashtable *in_expr_map,
+                                iHashtable *in_width_map,
+                                list_t *out_expr_list,
+                                list_t *out_expr_name_list,
+                                iHashtable *out_width_map,
+                                list_t *hidden_expr_list = NULL,
+                                list_t *hidden_expr_name_list = NULL);
+
+    /* same, with the output and hidden names in a map */
+    ExprBlockInfo *synth_exprs (std::string expr_set_name,
+                                list_t *in_expr_list,
+                                iHashtable *in_expr_map,
+                                iHashtable *in_width_map,
+                                list_t *out_expr_list,
+                                iHashtable *out_expr_map,
+                                iHashtable *out_width_map,
+                                list_t *hidden_expr_list = NULL);
+
+    /*
+        Look up a set of expressions with one read of the index.
+        results[i] is set for the ones that are in the cache (exactly
+        what synth_expr would return), and NULL for the others. 
+        Returns the indices of the misses, which can then be given to
+        synth_expr.
+    */
+    std::vector<int> lookup_batch (const std::vector<expr_cache_query> &,
+                                   std::vector<ExprBlockInfo *> &results);
+
+    /*
+        Start reading the cached files of a set of expressions in the
+        background, e.g. while other expressions are synthesized.
+    */
+    void prefetch (const std::vector<expr_cache_query> &);
+
+    /*
+        Area, delay and power of an expression only, for what-if
+        queries. The answer comes from the entries in memory and the
+        mapped snapshots: nothing is locked, no file is read or
+        copied, and nothing is added to the maps. Making the key
+        allocates like any other lookup; the key overload below does
+        not. The index is not re-read, so entries that others added
+        since it was last read are not seen. Returns false if the
+        expression is not known, unless synth is set: then a miss is
+        synthesized (as by synth_expr, but without making its
+        defproc). As in synth_expr, an expression keyed by its truth
+        table is also looked up by its structural key.
+    */
+    bool query_metrics (int targetwidth, Expr *, list_t *, iHashtable *, iHashtable *,
+                        expr_cache_record *rec, bool synth = false);
+
+    /* the same, for a key from expr_key(); only that key is tried */
+    bool query_metrics (const expr_hash &key, expr_cache_record *rec);
+
+    /* the key synth_expr uses for an expression */
+    expr_hash expr_key (int targetwidth, Expr *, iHashtable *, iHashtable *);
+
     /*
         Get path to cache that is being used.
     */
     std::string get_cache_loc ();
 
+    /*
+        With both synth.expropt.cache.local and .global set, the local
+        cache is the one that is used and written, and the global one
+        is a shared, read-only tier: lookups go local, then global,
+        then synthesis, and global hits are copied (promoted) to the
+        local cache. publish() adds the local entries that the global
+        cache does not have to it, batch entries per index write.
+    */
+    std::string get_global_cache_loc ();
+    bool publish (uint64_t batch = 256);
+
+    /*
+        Hit/miss statistics of this object so far; write_stats writes
+        them as JSON. If synth.expropt.cache.stats_file is set, they
+        are written there at destruction.
+    */
+    const expr_cache_stats &get_stats () { return stats; }
+    void write_stats (const std::string &);
+
+    /*
+        Wait until the new entries of this object are stored in the
+        cache and visible to other processes. Done at destruction.
+    */
+    void flush ();
+
     void set_expr_outfile(std::string x) {
         expr_output_file = x;
     }
@@ -61,32 +190,201 @@ public:
 private:
 
     void read_cache ();
-    void read_cache_unlocked ();
-    void read_cache_index_line (std::string);
-    void write_cache_index_line (std::string);
-    void write_cache_index_line_unlocked (std::string);
-    void rename_and_pipe (std::ifstream &, std::ofstream &, 
-                            const std::vector<std::string>, 
-                            const std::vector<std::string>);
+    bool read_cache_index_line (std::string, expr_hash *);
+    bool find_entry (const expr_hash &);
+    bool find_archived (const expr_hash &);
+    bool find_global (const expr_hash &);
+    void read_global ();
+    void _promote (const expr_cache_record &);
+    std::string _cache_dir (std::string);
+    void _add_record (const expr_cache_record &);
+    void rebuild_index_unlocked ();
+    void write_cache_index_lines (const std::vector<expr_hash> &);
+    void write_cache_index_lines_unlocked (const std::vector<expr_hash> &);
+    void rename_and_pipe (const std::string &, const std::string &,
+                            const std::vector<std::string> &, 
+                            const std::vector<std::string> &);
+    void copy_file (const std::string &, const std::string &, bool);
 
     void v2act_and_pipe (std::ifstream &src, std::ofstream &dst);
 
     int lock_file (std::string);
     void unlock_file (int);
 
-    std::string _gen_unique_id (Expr *, iHashtable *, iHashtable *, int);
+    /*
+        Per-key in-progress markers, so that different misses can be
+        synthesized at the same time while a second miss on the same
+        key waits for the first one's result.
+        claim_entry returns true if the caller now owns the marker and
+        has to synthesize the entry, false if the entry is in the cache.
+    */
+    std::string marker_file (const expr_hash &);
+    bool claim_entry (const expr_hash &);
+    bool marker_is_stale (const std::string &);
+    void release_entry (const expr_hash &);
+
+    expr_hash _gen_unique_id (Expr *, iHashtable *, iHashtable *, int,
+                              std::vector<Expr *> * = NULL, bool functional = true);
+
+    // expressions with at most function_bits input bits are keyed by
+    // their function (ExprIR::functionHash) rather than their
+    // structure; key_functional tells if the last key is one. The
+    // function key and leaf order of each structural key are kept, as
+    // positions in the structural leaf order.
+    struct function_key {
+        bool ok;
+        expr_hash key;
+        std::vector<int> order;
+    };
+    int function_bits;
+    bool key_functional;
+    std::unordered_map<expr_hash, function_key> function_keys;
+
+    // leaves that are not keys of the expr map are found through
+    // their ActId; the index is built once per map (and size)
+    iHashtable *leaf_index_map;
+    int leaf_index_n;
+    std::unordered_map<ActId *, Expr *> leaf_index;
+    Expr *_leaf_expr (iHashtable *, Expr *);
+
+    void _resolve_batch (const std::vector<expr_cache_query> &,
+                         std::vector<expr_hash> &,
+                         std::vector<std::vector<Expr *>> &,
+                         std::vector<bool> &);
+    void _prefetch_entries (const std::vector<expr_hash> &,
+                            const std::vector<bool> &);
+    ExprBlockInfo *_use_entry (const expr_hash &, const std::vector<Expr *> &,
+                               iHashtable *);
+    ExprBlockInfo *_emit_entry (const expr_hash &, const expr_hash &,
+                                const std::string &,
+                                const std::vector<std::string> &,
+                                const std::vector<std::string> &);
+    void _publish_entry (const expr_hash &, ExprBlockInfo *);
+    void _make_act (const std::string &, const std::string &);
 
     /*
-        define a next() function for the
-        expr_path type.
+        Write-behind of new entries. A miss can be used right away
+        from memory; a writer thread stores its files and then its
+        index line, so other processes only ever see complete
+        entries.
     */
-    expr_path gen_expr_path () {
-        return cache_counter++;
-    }
+    struct write_job {
+        expr_hash key;
+        std::string tmp[2];         // complete copies of the netlists,
+        std::string dst[2];         // next to their final names
+        std::string index_lines;
+        std::string key_lines;
+    };
+    std::thread writer;
+    std::mutex writer_mu;
+    std::condition_variable writer_cv;
+    std::deque<write_job> write_queue;
+    // queued or being written
+    std::unordered_set<expr_hash> write_pending;
+    // index lines the writer has appended: where (in the index with
+    // first line stamp), and for which keys
+    struct write_span {
+        std::string stamp;
+        uint64_t off;
+        uint64_t len;
+        std::vector<expr_hash> keys;
+    };
+    std::vector<write_span> write_done;
+    // main thread: new entries until read_cache has seen their
+    // index lines; kept over a reset of the maps by a gc
+    std::unordered_map<expr_hash, ExprBlockInfo> unread_entries;
+    void _take_write_spans ();
+    bool writer_exit;
+    void _writer_loop ();
+    void _write_entries (std::vector<write_job> &);
+    bool _is_pending (const expr_hash &);
+    std::string _format_index_lines (const std::vector<expr_hash> &, std::string *);
+
+    /*
+        Canonical port names of a multi-output block: in_<i>, out_<j>
+        and hid_<k>, numbered in canonical leaf order and in list
+        order. finds/replaces rename them back to the caller's names.
+    */
+    struct block_ports {
+        std::unordered_map<std::string, std::string> canon;
+        std::vector<Expr *> inputs;
+        std::vector<std::string> out_names;
+        std::vector<std::string> hidden_names;
+        std::vector<std::string> finds;
+        std::vector<std::string> replaces;
+    };
+    bool _gen_block_id (list_t *, iHashtable *, iHashtable *,
+                        list_t *, list_t *, iHashtable *,
+                        list_t *, list_t *,
+                        expr_hash *, block_ports *);
+
+    // used to compute the structural hash keys, and the canonical
+    // leaf order of the last key
+    ExprIR *key_ir;
+    std::vector<int> key_perm;
+
+    // fingerprint of the synthesis configuration, part of every key;
+    // <path>/config_<fingerprint>.txt lists what went into it
+    expr_hash config_fp;
+    std::string config_desc;
+    expr_hash _config_fingerprint (std::string *, expr_hash *);
+
+    // optimized AIGs (abc only), shared by all technologies and
+    // libraries: <cache>/aig/ab/cd/<key>.aig, or "" if not used.
+    // aig_fp is the part of config_fp they depend on, and aig_key
+    // the AIG key of the last key made
+    std::string aig_path;
+    expr_hash aig_fp;
+    expr_hash aig_key;
+    std::string _aig_begin ();
+    void _aig_end (const std::string &);
+
+    // full key strings, kept only for debugging (expr.keys)
+    bool debug_keys;
+    std::unordered_map<expr_hash, std::string> key_strings;
+
+    expr_path key_path (const expr_hash &);
+    std::string entry_file (const expr_path &);
+    void store_data (std::string_view, const std::string &);
+    void _link_tmp (const std::string &, const std::string &);
 
     std::string path;
     std::string index_file;
 
+    // readers take no locks; writers (appending to the index,
+    // rebuilding the snapshot, gc) hold the lock on this file
+    std::string lock_path;
+    // set once this object has added entries, which makes it do the
+    // index maintenance at exit
+    bool wrote_index;
+
+    // cached ACT defprocs are stored per v2act configuration
+    // (encoding, cell namespace, tie cells): <path>/<N>_<act_tag>.act
+    std::string act_tag;
+    std::string bindex_file;
+
+    // binary snapshot of the index, and the ids of the
+    // journal (text index) records that are not in it
+    ExprCacheIndex bindex;
+
+    // read-only tier (synth.expropt.cache.archive), or NULL
+    ExprCacheArchive *archive;
+
+    // global tier, or "": its snapshot, and the journal records
+    // after it, as of construction
+    std::string global_path;
+    ExprCacheIndex global_bindex;
+    std::unordered_map<expr_hash, expr_cache_record> global_tail;
+    std::vector<expr_hash> journal_tail;
+    // bytes of the journal that have been read (or written) so far
+    uint64_t journal_pos;
+    // first line of the index when it was last read
+    std::string index_stamp;
+    int index_rebuild_threshold;
+
+    // markers older than this (s) are assumed to be left over
+    int inprogress_timeout;
+
     char idx_file_delimiter;
     int n_metrics;
     int n_cols;
@@ -96,17 +394,25 @@ private:
 
     std::string _expr_file_path;
 
-    expr_path cache_counter;
-
     // ID-to-path
-    std::unordered_map<std::string, expr_path> path_map;
+    std::unordered_map<expr_hash, expr_path> path_map;
     // Path-to-info
     std::unordered_map<expr_path, ExprBlockInfo> info_map;
 
     // Keep track of which exprs have already been copied over
     // To avoid double-defining the same expr blk
-    std::unordered_set<std::string> runtime_accessed_set;
-    
-    std::unordered_set<std::string> dump_at_exit;
+    std::unordered_set<expr_hash> runtime_accessed_set;
+
+    expr_cache_stats stats;
+    std::string stats_file;
+    void _count_use (const expr_hash &, uint64_t &);
+
+    // uses of each entry since the last write of the access log
+    std::unordered_map<expr_hash, uint64_t> access_counts;
+    void write_access_log ();
+
+    // cache budget (0 = none); exceeding max_entries runs a gc at exit
+    uint64_t max_entries;
+    uint64_t max_bytes;
 
 };
\ No newline at end of file
@@ -0,0 +1,481 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <unordered_set>
+#include "expr_cache_archive.h"
+#include "expr_cache_gc.h"
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+static const char carc_magic[8] = { 'E', 'X', 'P', 'R', 'C', 'A', 'R', 'C' };
+static const uint32_t carc_version = 1;
+
+struct carc_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;    // sizeof(carc_entry), as a sanity check
+    uint64_t n_entries;
+    uint64_t entries_off;
+};
+
+struct carc_entry {
+    expr_cache_record rec;
+    uint64_t off[2];        // mapped, unmapped netlist
+    uint64_t len[2];
+};
+
+struct ExprCacheArchiveWriter::entry : public carc_entry { };
+
+ExprCacheArchive::ExprCacheArchive()
+{
+    base = NULL;
+    map_size = 0;
+}
+
+ExprCacheArchive::~ExprCacheArchive()
+{
+    close();
+}
+
+void ExprCacheArchive::close ()
+{
+    if (base) {
+        munmap (base, map_size);
+        base = NULL;
+        map_size = 0;
+    }
+}
+
+bool ExprCacheArchive::open (const std::string &fn)
+{
+    close();
+
+    int fd = ::open (fn.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if (fstat (fd, &st) == -1 || (size_t)st.st_size < sizeof (carc_header)) {
+        ::close (fd);
+        return false;
+    }
+    void *p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close (fd);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+
+    const carc_header *hdr = (const carc_header *) p;
+    bool ok = (memcmp (hdr->magic, carc_magic, sizeof (carc_magic)) == 0)
+        && hdr->version == carc_version
+        && hdr->entry_size == sizeof (carc_entry)
+        && hdr->entries_off >= sizeof (carc_header)
+        && (uint64_t)st.st_size == hdr->entries_off
+                                + hdr->n_entries * sizeof (carc_entry);
+    const carc_entry *ents = (const carc_entry *) ((const char *) p + hdr->entries_off);
+    for (uint64_t i = 0; ok && i < hdr->n_entries; i++) {
+        for (int j = 0; j < 2; j++) {
+            ok = ok && ents[i].off[j] + ents[i].len[j] <= hdr->entries_off;
+        }
+    }
+    if (!ok) {
+        munmap (p, st.st_size);
+        return false;
+    }
+    base = p;
+    map_size = st.st_size;
+    return true;
+}
+
+uint64_t ExprCacheArchive::size () const
+{
+    return base ? ((const carc_header *) base)->n_entries : 0;
+}
+
+static const carc_entry *archive_entries (const void *base)
+{
+    const carc_header *hdr = (const carc_header *) base;
+    return (const carc_entry *) ((const char *) base + hdr->entries_off);
+}
+
+int64_t ExprCacheArchive::lookup (const expr_hash &key) const
+{
+    if (!base) {
+        return -1;
+    }
+    const carc_entry *ents = archive_entries (base);
+    int64_t lo = 0, hi = size();
+    while (lo < hi) {
+        int64_t mid = (lo + hi) / 2;
+        const expr_cache_record &r = ents[mid].rec;
+        if (r.key_hi < key.hi || (r.key_hi == key.hi && r.key_lo < key.lo)) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo < (int64_t) size() && ents[lo].rec.key() == key) {
+        return lo;
+    }
+    return -1;
+}
+
+const expr_cache_record &ExprCacheArchive::record (int64_t i) const
+{
+    return archive_entries (base)[i].rec;
+}
+
+std::string_view ExprCacheArchive::netlist (int64_t i, bool unmapped) const
+{
+    const carc_entry &e = archive_entries (base)[i];
+    return std::string_view ((const char *) base + e.off[unmapped], e.len[unmapped]);
+}
+
+ExprCacheArchiveWriter::ExprCacheArchiveWriter()
+{
+    fp = NULL;
+    pos = 0;
+    ok = false;
+}
+
+ExprCacheArchiveWriter::~ExprCacheArchiveWriter()
+{
+    if (fp) {
+        fclose (fp);
+        unlink (tmp.c_str());
+    }
+}
+
+bool ExprCacheArchiveWriter::open (const std::string &name)
+{
+    fn = name;
+    tmp = fn + ".tmp." + std::to_string (getpid());
+    fp = fopen (tmp.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    // the header is written at the end, once it is known
+    carc_header hdr;
+    memset (&hdr, 0, sizeof (hdr));
+    ok = fwrite (&hdr, sizeof (hdr), 1, fp) == 1;
+    pos = sizeof (hdr);
+    entries.clear();
+    return ok;
+}
+
+bool ExprCacheArchiveWriter::add (const expr_cache_record &rec,
+                                  const std::string &netlist,
+                                  const std::string &unmapped)
+{
+    entry e;
+    e.rec = rec;
+    e.rec.loc = -1;
+    e.off[0] = pos;
+    e.len[0] = netlist.size();
+    e.off[1] = pos + netlist.size();
+    e.len[1] = unmapped.size();
+    ok = ok && fwrite (netlist.data(), 1, netlist.size(), fp) == netlist.size();
+    ok = ok && fwrite (unmapped.data(), 1, unmapped.size(), fp) == unmapped.size();
+    pos += netlist.size() + unmapped.size();
+    entries.push_back (e);
+    return ok;
+}
+
+bool ExprCacheArchiveWriter::close ()
+{
+    std::sort (entries.begin(), entries.end(), [](const entry &a, const entry &b) {
+        return a.rec.key_hi < b.rec.key_hi ||
+            (a.rec.key_hi == b.rec.key_hi && a.rec.key_lo < b.rec.key_lo);
+    });
+    for (auto &e : entries) {
+        ok = ok && fwrite ((carc_entry *) &e, sizeof (carc_entry), 1, fp) == 1;
+    }
+
+    carc_header hdr;
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.magic, carc_magic, sizeof (carc_magic));
+    hdr.version = carc_version;
+    hdr.entry_size = sizeof (carc_entry);
+    hdr.n_entries = entries.size();
+    hdr.entries_off = pos;
+    ok = ok && fseek (fp, 0, SEEK_SET) == 0;
+    ok = ok && fwrite (&hdr, sizeof (hdr), 1, fp) == 1;
+    ok = (fclose (fp) == 0) && ok;
+    fp = NULL;
+
+    if (ok) {
+        chmod (tmp.c_str(), 0664);
+        ok = (rename (tmp.c_str(), fn.c_str()) == 0);
+    }
+    if (!ok) {
+        unlink (tmp.c_str());
+    }
+    return ok;
+}
+
+static bool read_file (const std::string &fn, std::string *s)
+{
+    std::ifstream f(fn, std::ios::binary);
+    if (!f.is_open()) {
+        return false;
+    }
+    std::ostringstream buf;
+    buf << f.rdbuf();
+    *s = buf.str();
+    return true;
+}
+
+/*
+    Writers of a cache coordinate through expr.lock; readers do not
+    lock anything.
+*/
+static int lock_index (const std::string &dir)
+{
+    std::string fn = dir + "/" + expr_cache_lock_name;
+    int fd = open (fn.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        std::cerr << "Failed to open " << fn << "\n";
+        return -1;
+    }
+    if (flock (fd, LOCK_EX) == -1) {
+        std::cerr << "Failed to lock " << fn << "\n";
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void unlock_index (int fd)
+{
+    flock (fd, LOCK_UN);
+    close (fd);
+}
+
+/*
+    Append index lines to the journal of dir, with one write; a new
+    journal gets the header first. The caller holds the lock.
+*/
+static bool append_index (const std::string &dir, std::string out)
+{
+    std::string fn = dir + "/" + expr_cache_index_name;
+    int fd = open (fn.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0664);
+    if (fd == -1) {
+        std::cerr << "Failed to open " << fn << "\n";
+        return false;
+    }
+    if (lseek (fd, 0, SEEK_END) == 0) {
+        out = expr_cache_index_header() + out;
+    }
+    bool ok = write (fd, out.c_str(), out.size()) == (ssize_t) out.size();
+    close (fd);
+    return ok;
+}
+
+bool expr_cache_export (const std::string &dir, const std::string &fn,
+                        uint64_t *n)
+{
+    *n = 0;
+
+    // no lock: entries are complete before their index line is
+    // written, and an incomplete last line is skipped
+    ExprCacheArchiveWriter w;
+    bool ok = w.open (fn);
+    std::ifstream idx_file (dir + "/" + expr_cache_index_name);
+    std::unordered_set<expr_hash> seen = {};
+    std::string line, loc, v, pre;
+    expr_cache_record rec;
+    while (ok && std::getline (idx_file, line) && !idx_file.eof()) {
+        if (!expr_cache_parse_line (line, &rec, &loc) || seen.contains (rec.key())) {
+            continue;
+        }
+        // entries whose files are gone are left out
+        if (!read_file (dir + "/" + loc + ".v", &v) ||
+            !read_file (dir + "/" + loc + "pre.v", &pre)) {
+            continue;
+        }
+        seen.insert (rec.key());
+        ok = w.add (rec, v, pre);
+        (*n)++;
+    }
+    return ok && w.close ();
+}
+
+/*
+    Store the contents of a file under its final name, as ExprCache
+    does: a temporary file that is linked to the final name, unless
+    that exists already.
+*/
+static bool store_contents (std::string_view s, const std::string &dst)
+{
+    std::error_code ec;
+    fs::create_directories (fs::path (dst).parent_path(), ec);
+    std::string tmp = dst + ".tmp." + std::to_string (getpid());
+    std::ofstream f(tmp, std::ios::binary);
+    f.write (s.data(), s.size());
+    f.close();
+    if (f.fail()) {
+        unlink (tmp.c_str());
+        return false;
+    }
+    chmod (tmp.c_str(), 0664);
+    bool ok = link (tmp.c_str(), dst.c_str()) == 0 || errno == EEXIST;
+    unlink (tmp.c_str());
+    return ok;
+}
+
+/*
+    The keys in the index of dir; an incomplete last line is skipped.
+*/
+static void read_index_keys (const std::string &dir,
+                             std::unordered_set<expr_hash> *keys)
+{
+    std::ifstream idx_file (dir + "/" + expr_cache_index_name);
+    std::string line, loc;
+    expr_cache_record rec;
+    while (std::getline (idx_file, line) && !idx_file.eof()) {
+        if (expr_cache_parse_line (line, &rec, &loc)) {
+            keys->insert (rec.key());
+        }
+    }
+}
+
+bool expr_cache_import (const std::string &fn, const std::string &dir,
+                        uint64_t *added, uint64_t *skipped)
+{
+    *added = 0;
+    *skipped = 0;
+
+    ExprCacheArchive arc;
+    if (!arc.open (fn)) {
+        std::cerr << "Not an expression cache archive: " << fn << "\n";
+        return false;
+    }
+    std::error_code ec;
+    fs::create_directories (dir, ec);
+    int fd = lock_index (dir);
+    if (fd == -1) {
+        return false;
+    }
+
+    std::unordered_set<expr_hash> have = {};
+    read_index_keys (dir, &have);
+
+    std::string out = "";
+    bool ok = true;
+    for (uint64_t i = 0; ok && i < arc.size(); i++) {
+        const expr_cache_record &r = arc.record (i);
+        if (have.contains (r.key())) {
+            (*skipped)++;
+            continue;
+        }
+        std::string loc = expr_cache_key_path (r.key());
+        ok = store_contents (arc.netlist (i, false), dir + "/" + loc + ".v")
+            && store_contents (arc.netlist (i, true), dir + "/" + loc + "pre.v");
+        out.append (expr_cache_format_line (r, loc));
+        (*added)++;
+    }
+
+    // the index lines go in last, with one write
+    ok = ok && append_index (dir, out);
+    unlock_index (fd);
+    return ok;
+}
+
+bool expr_cache_publish (const std::string &src, const std::string &dst,
+                         uint64_t batch, uint64_t *added, uint64_t *skipped)
+{
+    *added = 0;
+    *skipped = 0;
+    if (batch == 0) {
+        batch = 1;
+    }
+
+    // the entries of src
+    std::ifstream idx_file (src + "/" + expr_cache_index_name);
+    std::vector<std::pair<expr_cache_record, std::string>> recs = {};
+    std::unordered_set<expr_hash> seen = {};
+    std::string line, src_loc;
+    expr_cache_record rec;
+    while (std::getline (idx_file, line) && !idx_file.eof()) {
+        if (expr_cache_parse_line (line, &rec, &src_loc) && !seen.contains (rec.key())) {
+            seen.insert (rec.key());
+            recs.push_back ({rec, src_loc});
+        }
+    }
+    idx_file.close();
+    int fd;
+
+    std::error_code ec;
+    fs::create_directories (dst, ec);
+    std::unordered_set<expr_hash> have = {};
+    read_index_keys (dst, &have);
+
+    bool ok = true;
+    std::string v, pre, out;
+    uint64_t n = 0;
+    for (size_t i = 0; ok && i <= recs.size(); i++) {
+        if (i < recs.size()) {
+            const expr_cache_record &r = recs[i].first;
+            if (have.contains (r.key())) {
+                (*skipped)++;
+                continue;
+            }
+            // entries whose files are gone are left out
+            if (!read_file (src + "/" + recs[i].second + ".v", &v) ||
+                !read_file (src + "/" + recs[i].second + "pre.v", &pre)) {
+                continue;
+            }
+            std::string loc = expr_cache_key_path (r.key());
+            ok = store_contents (v, dst + "/" + loc + ".v")
+                && store_contents (pre, dst + "/" + loc + "pre.v");
+            out.append (expr_cache_format_line (r, loc));
+            n++;
+        }
+        if (n == batch || (i == recs.size() && n > 0)) {
+            // the files are in place; now the index lines, with the
+            // lock held only for the write
+            fd = lock_index (dst);
+            if (fd == -1) {
+                return false;
+            }
+            ok = ok && append_index (dst, out);
+            unlock_index (fd);
+            *added += n;
+            out.clear();
+            n = 0;
+        }
+    }
+    return ok;
+}
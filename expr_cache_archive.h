@@ -0,0 +1,128 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************
+ */
+#ifndef __EXPR_CACHE_ARCHIVE_H__
+#define __EXPR_CACHE_ARCHIVE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "expr_cache_index.h"
+
+/*
+    A packed expression cache: the records and netlists of a set of
+    cache entries in a single file, so that a warm cache can be moved
+    around as one file instead of thousands of small ones.
+
+    File layout:
+        header
+        netlists (mapped and unmapped Verilog of every entry)
+        entries  [n_entries]  (record, offset and length of both
+                               netlists), sorted by key
+
+    The translated ACT defprocs are not stored; they depend on the
+    v2act configuration of the user of the cache, and are made again
+    from the netlist when needed.
+*/
+
+class ExprCacheArchive {
+public:
+
+    ExprCacheArchive();
+    ~ExprCacheArchive();
+
+    /*
+        Map an archive read-only. Returns false (and leaves the
+        archive empty) if the file is missing or not an archive.
+    */
+    bool open (const std::string &fn);
+    void close ();
+    bool is_open () { return base != NULL; }
+
+    uint64_t size () const;
+
+    /*
+        Find a key; returns the entry number, or -1.
+    */
+    int64_t lookup (const expr_hash &key) const;
+
+    const expr_cache_record &record (int64_t i) const;
+
+    /* the mapped (unmapped = false) or unmapped netlist of entry i */
+    std::string_view netlist (int64_t i, bool unmapped) const;
+
+private:
+
+    void *base;
+    size_t map_size;
+};
+
+/*
+    Writes an archive; entries can be added in any order. The archive
+    is written to a temporary file and renamed by close().
+*/
+class ExprCacheArchiveWriter {
+public:
+
+    ExprCacheArchiveWriter();
+    ~ExprCacheArchiveWriter();
+
+    bool open (const std::string &fn);
+    bool add (const expr_cache_record &rec,
+              const std::string &netlist, const std::string &unmapped);
+    bool close ();
+
+private:
+
+    struct entry;
+
+    FILE *fp;
+    std::string fn, tmp;
+    std::vector<entry> entries;
+    uint64_t pos;
+    bool ok;
+};
+
+/*
+    Pack all the entries of the cache in dir into an archive.
+    Returns false on error; *n is set to the number of entries.
+*/
+bool expr_cache_export (const std::string &dir, const std::string &fn,
+                        uint64_t *n);
+
+/*
+    Add the entries of an archive to the cache in dir (which is
+    created if needed), skipping the keys that are there already.
+*/
+bool expr_cache_import (const std::string &fn, const std::string &dir,
+                        uint64_t *added, uint64_t *skipped);
+
+/*
+    Add the entries of the cache in src to the cache in dst, skipping
+    the keys that dst has already. The index lines go in batch
+    entries at a time, so dst is not locked while files are copied.
+*/
+bool expr_cache_publish (const std::string &src, const std::string &dst,
+                         uint64_t batch, uint64_t *added, uint64_t *skipped);
+
+#endif /* __EXPR_CACHE_ARCHIVE_H__ */
@@ -0,0 +1,366 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "expr_cache_gc.h"
+#include "expr_cache_index.h"
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+// temporary files of processes that died, and files that no entry
+// refers to, are removed once they are older than this (s)
+static const int tmp_file_age = 3600;
+
+struct gc_entry {
+    expr_hash key;
+    std::string loc;
+    std::string line;
+    expr_cache_record rec;
+    uint64_t uses;
+    int64_t last_use;
+    uint64_t bytes;
+    bool has_netlist;
+};
+
+static bool parse_index_line (const std::string &line, gc_entry *e)
+{
+    if (!expr_cache_parse_line(line, &e->rec, &e->loc)) {
+        return false;
+    }
+    e->key = e->rec.key();
+    e->line = line;
+    e->uses = 0;
+    e->last_use = 0;
+    e->bytes = 0;
+    e->has_netlist = false;
+    return true;
+}
+
+/*
+    Entry files are <loc>.v, <loc>pre.v and <loc>_<tag>.act, where loc
+    is ab/cd/<key> or, for old entries, a number. Returns the location
+    (relative to the cache directory), or "" for anything else.
+*/
+static std::string entry_file_loc (const std::string &rel, bool *netlist)
+{
+    size_t dot = rel.rfind('.');
+    if (dot == std::string::npos) {
+        return "";
+    }
+    std::string stem = rel.substr(0, dot);
+    std::string ext = rel.substr(dot);
+    *netlist = false;
+    if (ext == ".v") {
+        if (stem.ends_with("pre")) {
+            stem.resize(stem.size() - 3);
+        }
+        else {
+            *netlist = true;
+        }
+    }
+    else if (ext == ".act") {
+        size_t us = stem.rfind('_');
+        if (us == std::string::npos) {
+            return "";
+        }
+        stem.resize(us);
+    }
+    else {
+        return "";
+    }
+
+    // ab/cd/<key>
+    expr_hash k;
+    if (stem.size() == 38 && stem[2] == '/' && stem[5] == '/' &&
+        k.from_hex(stem.substr(6)) &&
+        stem.compare(0, 2, stem, 6, 2) == 0 && stem.compare(3, 2, stem, 8, 2) == 0) {
+        return stem;
+    }
+    // old style number
+    if (stem.empty() || stem.size() > 18) {
+        return "";
+    }
+    for (auto c : stem) {
+        if (!isdigit(c)) {
+            return "";
+        }
+    }
+    return stem;
+}
+
+bool expr_cache_gc (const std::string &dir,
+                    const expr_cache_budget &budget,
+                    expr_cache_gc_stats *stats,
+                    bool have_lock)
+{
+    std::string index_fn = dir + "/" + expr_cache_index_name;
+    std::string access_fn = dir + "/" + expr_cache_access_name;
+    std::string lock_fn = dir + "/" + expr_cache_lock_name;
+    memset (stats, 0, sizeof (*stats));
+
+    if (!fs::exists(index_fn)) {
+        std::cerr << "Failed to open " << index_fn << "\n";
+        return false;
+    }
+    int fd = -1;
+    if (!have_lock) {
+        fd = open(lock_fn.c_str(), O_RDWR | O_CREAT, 0666);
+        if (fd == -1 || flock(fd, LOCK_EX) == -1) {
+            std::cerr << "Failed to lock " << lock_fn << "\n";
+            if (fd != -1) {
+                close(fd);
+            }
+            return false;
+        }
+    }
+
+    // the index: comment header, then records (the first one of a key
+    // wins; entries with old-style keys are dropped)
+    std::ifstream idx_file(index_fn);
+    std::string header = "", line;
+    std::vector<gc_entry> entries = {};
+    std::unordered_map<expr_hash, size_t> by_key = {};
+    bool in_header = true;
+    while (std::getline(idx_file, line)) {
+        if (line.empty() || line.at(0) == '#') {
+            // the first line of the old journal is not carried over
+            if (in_header && !line.starts_with("# compacted") &&
+                !line.starts_with("# expr.index ")) {
+                header.append(line + "\n");
+            }
+            continue;
+        }
+        in_header = false;
+        gc_entry e;
+        if (parse_index_line(line, &e) && !by_key.contains(e.key)) {
+            by_key.insert({e.key, entries.size()});
+            entries.push_back(e);
+        }
+    }
+    idx_file.close();
+
+    // uses from the access log, and the segments that runs have
+    // written since the last gc
+    std::vector<fs::path> segments = {};
+    for (auto &f : fs::directory_iterator(dir)) {
+        std::string name = f.path().filename().string();
+        if (name.starts_with(expr_cache_access_name + ".") &&
+            name.find(".tmp.") == std::string::npos) {
+            segments.push_back(f.path());
+        }
+    }
+    segments.push_back(access_fn);
+    for (auto &seg : segments) {
+        std::ifstream acc_file(seg);
+        while (std::getline(acc_file, line)) {
+            std::istringstream ss(line);
+            std::string hex;
+            uint64_t uses;
+            int64_t when;
+            expr_hash k;
+            if (!(ss >> hex >> uses >> when) || !k.from_hex(hex) || !by_key.contains(k)) {
+                continue;
+            }
+            gc_entry &e = entries[by_key.at(k)];
+            e.uses += uses;
+            e.last_use = std::max(e.last_use, when);
+        }
+    }
+    segments.pop_back();
+
+    // the files of every entry
+    std::unordered_map<std::string, size_t> by_loc = {};
+    for (size_t i=0; i<entries.size(); i++) {
+        by_loc.insert({entries[i].loc, i});
+    }
+    std::vector<std::pair<fs::path, std::string>> files = {};
+    std::vector<fs::path> orphans = {};
+    time_t now = time(NULL);
+    auto is_old = [now](const fs::path &p) {
+        struct stat st;
+        return stat(p.c_str(), &st) == 0 && now - st.st_mtime > tmp_file_age;
+    };
+    for (auto &f : fs::recursive_directory_iterator(dir)) {
+        if (!f.is_regular_file()) {
+            continue;
+        }
+        std::string name = f.path().filename().string();
+        if (name.find(".tmp.") != std::string::npos) {
+            if (is_old(f.path())) {
+                orphans.push_back(f.path());
+            }
+            continue;
+        }
+        bool netlist;
+        std::string loc = entry_file_loc(fs::relative(f.path(), dir).string(), &netlist);
+        if (loc.empty()) {
+            continue;
+        }
+        if (!by_loc.contains(loc)) {
+            // the files of a new entry are written before its index
+            // line, so a recent unreferenced file may be in use
+            if (is_old(f.path())) {
+                orphans.push_back(f.path());
+            }
+            continue;
+        }
+        gc_entry &e = entries[by_loc.at(loc)];
+        e.bytes += f.file_size();
+        e.has_netlist = e.has_netlist || netlist;
+        files.push_back({f.path(), loc});
+        stats->bytes_before += f.file_size();
+    }
+    stats->entries = entries.size();
+    stats->orphans = orphans.size();
+
+    // victims: entries without a netlist, then the cheapest ones while
+    // over budget. Evict down to 90% of the budget, so that gc does
+    // not run again right away.
+    std::vector<size_t> order = {};
+    std::vector<bool> keep(entries.size(), true);
+    uint64_t n_kept = 0, bytes_kept = 0;
+    for (size_t i=0; i<entries.size(); i++) {
+        if (!entries[i].has_netlist) {
+            keep[i] = false;
+            continue;
+        }
+        order.push_back(i);
+        n_kept++;
+        bytes_kept += entries[i].bytes;
+    }
+    if ((budget.max_entries && n_kept > budget.max_entries) ||
+        (budget.max_bytes && bytes_kept > budget.max_bytes)) {
+        auto value = [&](const gc_entry &e) {
+            return (double) (e.uses + 1) * (double) (e.rec.mapper_runtime + e.rec.io_runtime);
+        };
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            double va = value(entries[a]), vb = value(entries[b]);
+            if (va != vb) {
+                return va < vb;
+            }
+            return entries[a].last_use < entries[b].last_use;
+        });
+        uint64_t max_n = budget.max_entries ? budget.max_entries / 10 * 9 : UINT64_MAX;
+        uint64_t max_b = budget.max_bytes ? budget.max_bytes / 10 * 9 : UINT64_MAX;
+        for (size_t i=0; i<order.size() && (n_kept > max_n || bytes_kept > max_b); i++) {
+            keep[order[i]] = false;
+            n_kept--;
+            bytes_kept -= entries[order[i]].bytes;
+        }
+    }
+
+    // new index and snapshot, both renamed into place, so that
+    // readers (which take no lock) see either the old or the new one.
+    // The first line changes, which tells running caches to start
+    // over, and ties the snapshot to the new index.
+    std::string first = "# compacted " + std::to_string(now) + " "
+                        + std::to_string(getpid());
+    std::string out = first + "\n" + header;
+    std::vector<expr_cache_record> recs = {};
+    for (size_t i=0; i<entries.size(); i++) {
+        if (keep[i]) {
+            out.append(entries[i].line + "\n");
+            recs.push_back(entries[i].rec);
+        }
+    }
+    bool ok = ExprCacheIndex::write(dir + "/" + expr_cache_bindex_name, recs, 
+                                    out.size(), expr_cache_journal_stamp(first));
+    if (ok) {
+        std::string tmp = index_fn + ".tmp." + std::to_string(getpid());
+        int ifd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0664);
+        ok = ifd != -1 && write(ifd, out.c_str(), out.size()) == (ssize_t)out.size()
+                && fsync(ifd) == 0;
+        if (ifd != -1) {
+            close(ifd);
+        }
+        ok = ok && rename(tmp.c_str(), index_fn.c_str()) == 0;
+        if (!ok) {
+            unlink(tmp.c_str());
+        }
+    }
+
+    // access log, with the uses of the kept entries halved
+    if (ok) {
+        std::string tmp = access_fn + ".tmp." + std::to_string(getpid());
+        std::ofstream acc_out(tmp);
+        for (size_t i=0; i<entries.size(); i++) {
+            if (keep[i] && entries[i].uses > 1) {
+                acc_out << entries[i].key.hex() << " " << entries[i].uses / 2
+                        << " " << entries[i].last_use << "\n";
+            }
+        }
+        acc_out.close();
+        ok = !acc_out.fail();
+        if (ok) {
+            chmod(tmp.c_str(), 0664);
+            fs::rename(tmp, access_fn);
+            std::error_code ec;
+            for (auto &seg : segments) {
+                fs::remove(seg, ec);
+            }
+        }
+    }
+
+    // only now that nothing refers to them, remove the files
+    if (ok) {
+        std::error_code ec;
+        for (auto &f : files) {
+            if (keep[by_loc.at(f.second)]) {
+                stats->bytes_after += fs::file_size(f.first, ec);
+            }
+            else {
+                orphans.push_back(f.first);
+            }
+        }
+        for (auto &f : orphans) {
+            fs::remove(f, ec);
+            // and the (two levels of) shard directories that became empty
+            fs::path d = f.parent_path();
+            for (int i=0; i<2 && !fs::equivalent(d, dir, ec); i++, d = d.parent_path()) {
+                if (!fs::is_empty(d, ec) || !fs::remove(d, ec)) {
+                    break;
+                }
+            }
+        }
+        stats->evicted = entries.size() - recs.size();
+    }
+
+    if (fd != -1) {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+    return ok;
+}
@@ -0,0 +1,77 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************
+ */
+#ifndef __EXPR_CACHE_GC_H__
+#define __EXPR_CACHE_GC_H__
+
+#include <stdint.h>
+#include <string>
+
+/*
+    Eviction and compaction of an expression cache directory.
+
+    Every ExprCache writes the number of times it used each entry to
+    an access log segment (expr.access.<time>.<host>.<pid>) when it
+    exits. Garbage collection sums the segments and the access log
+    (expr.access) per entry and, while the cache is over its budget,
+    evicts the entries that are worth the least: the ones with the
+    smallest (uses x synthesis time), the least recently used first
+    among equals. It then
+        - writes a new expr.bidx snapshot, and a new expr.index with
+          only the kept records, under a new first line so that
+          running caches re-read it,
+        - merges the segments into expr.access, with the uses halved,
+          so that old popularity fades,
+        - removes the files of evicted entries, and files that no
+          entry refers to or temporary files left by dead processes
+          once they are an hour old.
+*/
+
+struct expr_cache_budget {
+    uint64_t max_entries;   // 0 = no limit
+    uint64_t max_bytes;     // 0 = no limit
+};
+
+struct expr_cache_gc_stats {
+    uint64_t entries;       // entries before gc
+    uint64_t evicted;
+    uint64_t orphans;       // unreferenced files removed
+    uint64_t bytes_before;
+    uint64_t bytes_after;
+};
+
+/*
+    Garbage-collect the cache in dir. Takes the writer lock
+    (expr.lock) unless the caller already holds it. Returns false
+    if the cache could not be read or written.
+*/
+bool expr_cache_gc (const std::string &dir,
+                    const expr_cache_budget &budget,
+                    expr_cache_gc_stats *stats,
+                    bool have_lock = false);
+
+/* file names used in the cache directory */
+static const std::string expr_cache_index_name = "expr.index";
+static const std::string expr_cache_bindex_name = "expr.bidx";
+static const std::string expr_cache_access_name = "expr.access";
+static const std::string expr_cache_lock_name = "expr.lock";
+
+#endif /* __EXPR_CACHE_GC_H__ */
@@ -0,0 +1,346 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************
+ */
+
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sstream>
+#include <random>
+#include "expr_cache_index.h"
+
+static const char bidx_magic[8] = { 'E', 'X', 'P', 'R', 'B', 'I', 'D', 'X' };
+static const uint32_t bidx_version = 3;
+
+struct bidx_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;   // sizeof(expr_cache_record), as a sanity check
+    uint64_t n_slots;       // power of 2
+    uint64_t n_records;
+    uint64_t journal_off;
+    uint64_t stamp_hi;      // expr_cache_journal_stamp of the journal
+    uint64_t stamp_lo;
+};
+
+struct bidx_slot {
+    uint64_t key_lo;        // copy of the low half of the key
+    uint64_t rec;           // record index + 1, 0 if empty
+};
+
+ExprCacheIndex::ExprCacheIndex()
+{
+    base = NULL;
+    map_size = 0;
+}
+
+ExprCacheIndex::~ExprCacheIndex()
+{
+    close();
+}
+
+void ExprCacheIndex::close ()
+{
+    if (base) {
+        munmap (base, map_size);
+        base = NULL;
+        map_size = 0;
+    }
+}
+
+bool ExprCacheIndex::open (const std::string &fn)
+{
+    close();
+
+    int fd = ::open (fn.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if (fstat (fd, &st) == -1 || (size_t)st.st_size < sizeof (bidx_header)) {
+        ::close (fd);
+        return false;
+    }
+    void *p = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close (fd);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+
+    // validate the header against the file size
+    const bidx_header *hdr = (const bidx_header *) p;
+    bool ok = (memcmp (hdr->magic, bidx_magic, sizeof (bidx_magic)) == 0)
+        && hdr->version == bidx_version
+        && hdr->record_size == sizeof (expr_cache_record)
+        && hdr->n_slots > 0
+        && (hdr->n_slots & (hdr->n_slots - 1)) == 0
+        && hdr->n_records < hdr->n_slots
+        && (uint64_t)st.st_size == sizeof (bidx_header)
+                                + hdr->n_slots * sizeof (bidx_slot)
+                                + hdr->n_records * sizeof (expr_cache_record);
+    if (!ok) {
+        munmap (p, st.st_size);
+        return false;
+    }
+    base = p;
+    map_size = st.st_size;
+    return true;
+}
+
+uint64_t ExprCacheIndex::size () const
+{
+    return base ? ((const bidx_header *) base)->n_records : 0;
+}
+
+uint64_t ExprCacheIndex::journal_offset () const
+{
+    return base ? ((const bidx_header *) base)->journal_off : 0;
+}
+
+expr_hash ExprCacheIndex::stamp () const
+{
+    if (!base) {
+        return expr_hash{0, 0};
+    }
+    const bidx_header *hdr = (const bidx_header *) base;
+    return expr_hash{hdr->stamp_hi, hdr->stamp_lo};
+}
+
+bool ExprCacheIndex::lookup (const expr_hash &key,
+                             expr_cache_record *rec) const
+{
+    if (!base) {
+        return false;
+    }
+    const bidx_header *hdr = (const bidx_header *) base;
+    const bidx_slot *slots = (const bidx_slot *) (hdr + 1);
+    const expr_cache_record *recs =
+            (const expr_cache_record *) (slots + hdr->n_slots);
+    uint64_t mask = hdr->n_slots - 1;
+
+    // keys are already hashes, so the low half picks the slot
+    for (uint64_t i = key.lo & mask; slots[i].rec != 0; i = (i + 1) & mask) {
+        if (slots[i].key_lo != key.lo) {
+            continue;
+        }
+        const expr_cache_record *r = &recs[slots[i].rec - 1];
+        if (r->key_hi == key.hi) {
+            *rec = *r;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ExprCacheIndex::for_each (
+                std::function<void (const expr_cache_record &)> f) const
+{
+    if (!base) {
+        return;
+    }
+    const bidx_header *hdr = (const bidx_header *) base;
+    const bidx_slot *slots = (const bidx_slot *) (hdr + 1);
+    const expr_cache_record *recs =
+            (const expr_cache_record *) (slots + hdr->n_slots);
+
+    for (uint64_t i = 0; i < hdr->n_records; i++) {
+        f (recs[i]);
+    }
+}
+
+bool ExprCacheIndex::write (const std::string &fn,
+                            const std::vector<expr_cache_record> &recs,
+                            uint64_t journal_off, const expr_hash &stamp)
+{
+    // load factor at most 1/2
+    uint64_t n_slots = 16;
+    while (n_slots < 2 * recs.size()) {
+        n_slots <<= 1;
+    }
+
+    bidx_header hdr;
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.magic, bidx_magic, sizeof (bidx_magic));
+    hdr.version = bidx_version;
+    hdr.record_size = sizeof (expr_cache_record);
+    hdr.n_slots = n_slots;
+    hdr.n_records = recs.size();
+    hdr.journal_off = journal_off;
+    hdr.stamp_hi = stamp.hi;
+    hdr.stamp_lo = stamp.lo;
+
+    std::vector<bidx_slot> slots (n_slots, bidx_slot{0, 0});
+    uint64_t mask = n_slots - 1;
+
+    for (uint64_t i = 0; i < recs.size(); i++) {
+        uint64_t j = recs[i].key_lo & mask;
+        while (slots[j].rec != 0) {
+            j = (j + 1) & mask;
+        }
+        slots[j].key_lo = recs[i].key_lo;
+        slots[j].rec = i + 1;
+    }
+
+    std::string tmp = fn + ".tmp." + std::to_string (getpid());
+    FILE *fp = fopen (tmp.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fwrite (&hdr, sizeof (hdr), 1, fp) == 1;
+    ok = ok && fwrite (slots.data(), sizeof (bidx_slot), n_slots, fp) == n_slots;
+    ok = ok && fwrite (recs.data(), sizeof (expr_cache_record), recs.size(), fp)
+                == recs.size();
+    ok = (fclose (fp) == 0) && ok;
+
+    if (ok) {
+        chmod (tmp.c_str(), 0664);
+        ok = (rename (tmp.c_str(), fn.c_str()) == 0);
+    }
+    if (!ok) {
+        unlink (tmp.c_str());
+    }
+    return ok;
+}
+
+bool expr_cache_parse_line (const std::string &line,
+                            expr_cache_record *rec, std::string *loc)
+{
+    std::istringstream ss(line);
+    std::vector<std::string> tokens = {};
+    std::string token;
+    while (std::getline(ss, token, ' ')) {
+        tokens.push_back(token);
+    }
+    expr_hash k;
+    if (tokens.size() != 17 || !k.from_hex(tokens[0])) {
+        return false;
+    }
+    try {
+        *loc = tokens[1];
+        rec->key_hi = k.hi;
+        rec->key_lo = k.lo;
+        rec->loc = (loc->find('/') == std::string::npos) ? std::stoll(*loc) : -1;
+        for (int i=0; i<12; i++) {
+            rec->metrics[i] = std::stod(tokens[2+i]);
+        }
+        rec->area = std::stod(tokens[14]);
+        rec->mapper_runtime = (int64_t) std::stod(tokens[15]);
+        rec->io_runtime = (int64_t) std::stod(tokens[16]);
+    }
+    catch (std::exception &) {
+        return false;
+    }
+    return true;
+}
+
+std::string expr_cache_format_line (const expr_cache_record &rec,
+                                    const std::string &loc)
+{
+    std::ostringstream buf;
+    buf << rec.key().hex() << ' ' << loc;
+    for (int i=0; i<12; i++) {
+        buf << ' ' << rec.metrics[i];
+    }
+    buf << ' ' << rec.area << ' ' << rec.mapper_runtime << ' ' << rec.io_runtime << "\n";
+    return buf.str();
+}
+
+std::string expr_cache_key_path (const expr_hash &key)
+{
+    std::string hex = key.hex();
+    return hex.substr(0, 2) + "/" + hex.substr(2, 2) + "/" + hex;
+}
+
+std::string expr_cache_index_header ()
+{
+    // the first line tells this journal from any other one made in
+    // the same place, e.g. before an invalidate
+    std::random_device rd;
+    std::string first = "# expr.index " + std::to_string (time (NULL)) + " "
+        + std::to_string (getpid()) + " " + std::to_string (rd()) + "\n";
+    std::string rule = "# " + std::string(120, '-') + "\n";
+    return first + rule
+        + "# Expression cache index and metrics file\n"
+        + "# Metrics except area are in triplets (min,typ,max)\n"
+        + "# Format: <key> <file_name> <delay> <static power> <dynamic power> <total power> <area> <mapper_runtime> <io_runtime>\n"
+        + "# Type: <128-bit hex> <path> <double (s)> <double (W)> <double (W)> <double (W)> <double (W)> <mapper_runtime (us)> <io_runtime (us)>\n"
+        + rule;
+}
+
+expr_hash expr_cache_journal_stamp (const std::string &first_line)
+{
+    ExprHasher h;
+    h.add (first_line);
+    return h.value();
+}
+
+void expr_cache_rename_ids (std::string_view text,
+                            const std::unordered_map<std::string_view, std::string_view> &rmap,
+                            std::string *res)
+{
+    auto id_char = [](char c) { return isalnum(c) || c == '_' || c == '$'; };
+    size_t i = 0;
+    while (i < text.size()) {
+        if (text[i] == '\\') {
+            // escaped identifier, up to the next white space
+            size_t j = text.find_first_of(" \t\n", i);
+            j = (j == std::string::npos) ? text.size() : j;
+            res->append(text, i, j - i);
+            i = j;
+        }
+        else if (isalpha(text[i]) || text[i] == '_') {
+            size_t j = i;
+            while (j < text.size() && id_char(text[j])) {
+                j++;
+            }
+            auto it = rmap.find(text.substr(i, j - i));
+            if (it != rmap.end()) {
+                res->append(it->second);
+            }
+            else {
+                res->append(text, i, j - i);
+            }
+            i = j;
+        }
+        else if (isdigit(text[i])) {
+            // numbers, including sized constants like 4'hf
+            size_t j = i;
+            while (j < text.size() && (id_char(text[j]) || text[j] == '\'')) {
+                j++;
+            }
+            res->append(text, i, j - i);
+            i = j;
+        }
+        else {
+            size_t j = i + 1;
+            while (j < text.size() && !isalnum(text[j]) && text[j] != '_' && text[j] != '\\') {
+                j++;
+            }
+            res->append(text, i, j - i);
+            i = j;
+        }
+    }
+}
@@ -0,0 +1,154 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************
+ */
+#ifndef __EXPR_CACHE_INDEX_H__
+#define __EXPR_CACHE_INDEX_H__
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include "expr_hash.h"
+
+/*
+    Binary, memory-mapped snapshot of the expression cache index.
+
+    The text index (expr.index) is the append-only journal and export
+    format. The snapshot (expr.bidx) holds all the records of the
+    first journal_offset() bytes of the journal in an open-addressing
+    hash table keyed by the 128-bit expression key, so that a lookup
+    only touches a few pages and opening the cache does not parse the
+    journal. Only the journal records after the snapshot need to be
+    parsed.
+
+    A snapshot is never modified in place; a new one is written to a
+    temporary file and renamed over the old one. A gc replaces the
+    journal as well (also by a rename), so a snapshot records the
+    stamp of the journal it was made from, and is only used with it.
+
+    File layout:
+        header
+        slots   [n_slots]   (low half of key, record index + 1; 0 = empty)
+        records [n_records]
+*/
+
+/*
+    One cache entry as stored in the snapshot.
+*/
+struct expr_cache_record {
+    uint64_t key_hi;        // expr_hash of the entry
+    uint64_t key_lo;
+    int64_t loc;            // file number of entries from before the
+                            // sharded layout, -1 = ab/cd/<key>
+    double metrics[12];     // delay, power, static power, dynamic power
+                            // each as (min, typ, max)
+    double area;
+    int64_t mapper_runtime; // us
+    int64_t io_runtime;     // us
+
+    expr_hash key () const { return expr_hash{key_hi, key_lo}; }
+};
+
+/*
+    Lines of the text journal (expr.index):
+        <key> <loc> <12 metrics> <area> <mapper runtime> <io runtime>
+    where loc is the path of the entry files without extension.
+    parse returns false for comments and malformed lines, and for
+    entries keyed by expression strings (older versions).
+*/
+bool expr_cache_parse_line (const std::string &line,
+                            expr_cache_record *rec, std::string *loc);
+std::string expr_cache_format_line (const expr_cache_record &rec,
+                                    const std::string &loc);
+
+/* path of the files of an entry, without extension: ab/cd/<key> */
+std::string expr_cache_key_path (const expr_hash &key);
+
+/*
+    comment block at the start of a new journal; its first line is
+    unique, so that it identifies the journal
+*/
+std::string expr_cache_index_header ();
+
+/* identifies a journal, from its first line */
+expr_hash expr_cache_journal_stamp (const std::string &first_line);
+
+/*
+    Append text to *res, replacing every whole identifier that is a
+    key of rmap with its value, in a single pass. Escaped identifiers
+    and numbers (including sized constants like 4'hf) are copied
+    unchanged. Identifiers must not span the end of text.
+*/
+void expr_cache_rename_ids (std::string_view text,
+                            const std::unordered_map<std::string_view, std::string_view> &rmap,
+                            std::string *res);
+
+class ExprCacheIndex {
+public:
+
+    ExprCacheIndex();
+    ~ExprCacheIndex();
+
+    /*
+        Map a snapshot file. Returns false (and leaves the index
+        empty) if the file does not exist or is not a valid snapshot.
+    */
+    bool open (const std::string &fn);
+    void close ();
+
+    bool is_open () { return base != NULL; }
+
+    /*
+        Find a key; on success the record is copied to *rec.
+    */
+    bool lookup (const expr_hash &key, expr_cache_record *rec) const;
+
+    /* number of records in the snapshot */
+    uint64_t size () const;
+
+    /* length of the text journal prefix covered by the snapshot */
+    uint64_t journal_offset () const;
+
+    /* expr_cache_journal_stamp of that journal */
+    expr_hash stamp () const;
+
+    /* visit all records */
+    void for_each (std::function<void (const expr_cache_record &)>) const;
+
+    /*
+        Write a new snapshot holding recs, covering the first
+        journal_off bytes of the journal with the given stamp. The
+        file is written to a temporary name and renamed, so readers
+        that have the old snapshot mapped are not affected.
+    */
+    static bool write (const std::string &fn,
+                       const std::vector<expr_cache_record> &recs,
+                       uint64_t journal_off, const expr_hash &stamp);
+
+private:
+
+    void *base;
+    size_t map_size;
+};
+
+#endif /* __EXPR_CACHE_INDEX_H__ */
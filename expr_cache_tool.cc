@@ -0,0 +1,164 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "expr_cache_gc.h"
+#include "expr_cache_archive.h"
+
+/*
+ * expropt-cache: offline maintenance of an expression cache
+ * directory (<cache>/<tech>/<mapper>).
+ */
+
+static void usage (char *name)
+{
+  fprintf (stderr, "Usage: %s gc [-n <max entries>] [-s <max size (MB)>] <cache dir>\n", name);
+  fprintf (stderr, "       %s export <cache dir> <archive>\n", name);
+  fprintf (stderr, "       %s import <archive> <cache dir>\n", name);
+  fprintf (stderr, "       %s publish [-b <batch>] <local cache dir> <global cache dir>\n", name);
+  fprintf (stderr, "  gc: compact the index, evict entries over the budget,\n"
+	   "      and remove files that no entry refers to\n");
+  fprintf (stderr, "  export: pack all entries of a cache into one archive file\n");
+  fprintf (stderr, "  import: add the entries of an archive to a cache, skipping\n"
+	   "      the ones it has already\n");
+  fprintf (stderr, "  publish: add the entries of a local cache to a global one,\n"
+	   "      <batch> (default 256) entries per index update\n");
+  exit (1);
+}
+
+static int do_gc (char *name, int argc, char **argv)
+{
+  expr_cache_budget budget;
+  expr_cache_gc_stats st;
+  int ch;
+
+  budget.max_entries = 0;
+  budget.max_bytes = 0;
+  while ((ch = getopt (argc, argv, "n:s:")) != -1) {
+    switch (ch) {
+    case 'n':
+      budget.max_entries = strtoull (optarg, NULL, 10);
+      break;
+    case 's':
+      budget.max_bytes = strtoull (optarg, NULL, 10) << 20;
+      break;
+    default:
+      usage (name);
+      break;
+    }
+  }
+  if (optind != argc - 1) {
+    usage (name);
+  }
+
+  if (!expr_cache_gc (argv[optind], budget, &st)) {
+    fprintf (stderr, "%s: gc of `%s' failed\n", name, argv[optind]);
+    return 1;
+  }
+  printf ("%llu entries, %llu evicted, %llu unreferenced files removed\n",
+	  (unsigned long long) st.entries, (unsigned long long) st.evicted,
+	  (unsigned long long) st.orphans);
+  printf ("%.1f MB -> %.1f MB\n", st.bytes_before / 1048576.0,
+	  st.bytes_after / 1048576.0);
+  return 0;
+}
+
+static int do_export (char *name, int argc, char **argv)
+{
+  uint64_t n;
+
+  if (argc != 3) {
+    usage (name);
+  }
+  if (!expr_cache_export (argv[1], argv[2], &n)) {
+    fprintf (stderr, "%s: export of `%s' failed\n", name, argv[1]);
+    return 1;
+  }
+  printf ("%llu entries written to %s\n", (unsigned long long) n, argv[2]);
+  return 0;
+}
+
+static int do_import (char *name, int argc, char **argv)
+{
+  uint64_t added, skipped;
+
+  if (argc != 3) {
+    usage (name);
+  }
+  if (!expr_cache_import (argv[1], argv[2], &added, &skipped)) {
+    fprintf (stderr, "%s: import of `%s' failed\n", name, argv[1]);
+    return 1;
+  }
+  printf ("%llu entries added, %llu already present\n",
+	  (unsigned long long) added, (unsigned long long) skipped);
+  return 0;
+}
+
+static int do_publish (char *name, int argc, char **argv)
+{
+  uint64_t batch = 256, added, skipped;
+  int ch;
+
+  while ((ch = getopt (argc, argv, "b:")) != -1) {
+    switch (ch) {
+    case 'b':
+      batch = strtoull (optarg, NULL, 10);
+      break;
+    default:
+      usage (name);
+      break;
+    }
+  }
+  if (optind != argc - 2) {
+    usage (name);
+  }
+  if (!expr_cache_publish (argv[optind], argv[optind+1], batch, &added, &skipped)) {
+    fprintf (stderr, "%s: publish of `%s' failed\n", name, argv[optind]);
+    return 1;
+  }
+  printf ("%llu entries added, %llu already present\n",
+	  (unsigned long long) added, (unsigned long long) skipped);
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  if (argc < 2) {
+    usage (argv[0]);
+  }
+  if (strcmp (argv[1], "gc") == 0) {
+    return do_gc (argv[0], argc - 1, argv + 1);
+  }
+  if (strcmp (argv[1], "export") == 0) {
+    return do_export (argv[0], argc - 1, argv + 1);
+  }
+  if (strcmp (argv[1], "import") == 0) {
+    return do_import (argv[0], argc - 1, argv + 1);
+  }
+  if (strcmp (argv[1], "publish") == 0) {
+    return do_publish (argv[0], argc - 1, argv + 1);
+  }
+  usage (argv[0]);
+  return 1;
+}
@@ -0,0 +1,121 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************/
+#ifndef __EXPR_HASH_H__
+#define __EXPR_HASH_H__
+
+#include <string>
+#include <functional>
+#include <stddef.h>
+
+/*
+ * 128-bit hash value.
+ */
+struct expr_hash {
+  unsigned long long hi, lo;
+
+  bool operator== (const expr_hash &h) const {
+    return hi == h.hi && lo == h.lo;
+  }
+  bool operator!= (const expr_hash &h) const {
+    return !(*this == h);
+  }
+
+  /* 32 lower-case hex digits, most significant first */
+  std::string hex () const {
+    static const char digits[] = "0123456789abcdef";
+    std::string ret (32, '0');
+    for (int i=0; i < 16; i++) {
+      ret[15-i] = digits[(hi >> (4*i)) & 0xf];
+      ret[31-i] = digits[(lo >> (4*i)) & 0xf];
+    }
+    return ret;
+  }
+
+  /* parse the output of hex(); returns false if s is not 32 hex digits */
+  bool from_hex (const std::string &s) {
+    unsigned long long v[2] = { 0, 0 };
+    if (s.size() != 32) {
+      return false;
+    }
+    for (int i=0; i < 32; i++) {
+      int d;
+      if (s[i] >= '0' && s[i] <= '9') d = s[i] - '0';
+      else if (s[i] >= 'a' && s[i] <= 'f') d = s[i] - 'a' + 10;
+      else return false;
+      v[i/16] = (v[i/16] << 4) | d;
+    }
+    hi = v[0];
+    lo = v[1];
+    return true;
+  }
+};
+
+namespace std {
+  template<> struct hash<expr_hash> {
+    size_t operator() (const expr_hash &h) const {
+      return (size_t) (h.lo ^ (h.hi * 0x9e3779b97f4a7c15ULL));
+    }
+  };
+}
+
+/*
+ * Streaming 128-bit FNV-1a hash. Not cryptographic, but wide enough
+ * that collisions between distinct expression blocks are not a
+ * practical concern.
+ */
+class ExprHasher {
+public:
+  ExprHasher () { reset (); }
+
+  void reset () {
+    _h = ((unsigned __int128)0x6c62272e07bb0142ULL << 64) | 0x62b821756295c58dULL;
+  }
+
+  void add (const void *buf, size_t len) {
+    const unsigned __int128 prime =
+      ((unsigned __int128)0x0000000001000000ULL << 64) | 0x000000000000013bULL;
+    const unsigned char *s = (const unsigned char *) buf;
+    for (size_t i=0; i < len; i++) {
+      _h ^= s[i];
+      _h *= prime;
+    }
+  }
+
+  void add (const std::string &s) {
+    add (s.c_str(), s.size() + 1);
+  }
+
+  void add (long v) {
+    add (&v, sizeof (v));
+  }
+
+  expr_hash value () const {
+    expr_hash ret;
+    ret.hi = (unsigned long long) (_h >> 64);
+    ret.lo = (unsigned long long) _h;
+    return ret;
+  }
+
+private:
+  unsigned __int128 _h;
+};
+
+#endif /* __EXPR_HASH_H__ */
@@ -19,7 +19,8 @@
  *
  **************************************************************************
  */
-#pragma once
+#ifndef __EXPR_INFO_H__
+#define __EXPR_INFO_H__
 
 #include <act/types.h>
 #include <common/int.h>
@@ -94,6 +95,12 @@ struct act_syn_info {
   std::string toplevel;
   bool use_tie_cells;
   void *space;			// use for whatever you want!
+
+  /* technology-independent AIG (only used by the abc mapper): if
+     aig_in is set, start from this optimized AIG and only map it;
+     otherwise, if aig_out is set, save the optimized AIG there */
+  std::string aig_in;
+  std::string aig_out;
 };
 
 class ExprBlockInfo {
@@ -166,3 +173,5 @@ public:
 
     bool exists() { return (area != -1); }
 };
+
+#endif /* __EXPR_INFO_H__ */
@@ -0,0 +1,1128 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************/
+#include "expr_ir.h"
+#include <common/int.h>
+#include <common/hash.h>
+#include <string.h>
+#include <algorithm>
+
+ExprIR::ExprIR ()
+{
+  _leafmap = NULL;
+  _leafwidth = NULL;
+  _unknown_width = 0;
+  _emap = phash_new (8);
+  _lnames = hash_new (8);
+}
+
+ExprIR::~ExprIR ()
+{
+  phash_free (_emap);
+  hash_free (_lnames);
+}
+
+void ExprIR::setLeafInfo (iHashtable *leafmap, leaf_width_fn fn)
+{
+  _leafmap = leafmap;
+  _leafwidth = fn;
+}
+
+void ExprIR::clear ()
+{
+  _nodes.clear ();
+  _leaves.clear ();
+  _roots.clear ();
+  _args.clear ();
+  _unknown_width = 0;
+  phash_clear (_emap);
+  hash_clear (_lnames);
+}
+
+int ExprIR::_newnode (int type, Expr *e)
+{
+  expr_ir_node n;
+  n.type = type;
+  n.width = -1;
+  n.op[0] = -1;
+  n.op[1] = -1;
+  n.op[2] = -1;
+  n.leaf = -1;
+  n.val = 0;
+  n.val2 = 0;
+  n.e = e;
+  _nodes.push_back (n);
+  return _nodes.size()-1;
+}
+
+/*
+ * Find or create the leaf for the variable (or mapped constant) e. The
+ * leaf is identified by its name in the leaf map, or by the printed
+ * identifier if there is no leaf map.
+ */
+int ExprIR::_leaf (Expr *e, const char *name)
+{
+  hash_bucket_t *b;
+  char buf[1024];
+  const char *key;
+
+  if (name) {
+    key = name;
+  }
+  else {
+    Assert (e->type == E_VAR, "Unnamed constant leaf?");
+    ((ActId *)e->u.e.l)->sPrint (buf, 1024);
+    key = buf;
+  }
+
+  b = hash_lookup (_lnames, key);
+  if (b) {
+    return b->i;
+  }
+
+  expr_ir_leaf l;
+  l.name = name;
+  l.id = (e->type == E_VAR) ? (ActId *)e->u.e.l : NULL;
+  l.node = _nodes.size();
+  if (e->type == E_VAR) {
+    l.width = _leafwidth ? _leafwidth (e, name) : -1;
+  }
+  else if (e->type == E_INT) {
+    l.width = 64;
+  }
+  else {
+    l.width = 1;
+  }
+  _leaves.push_back (l);
+
+  b = hash_add (_lnames, key);
+  b->i = _leaves.size()-1;
+  return b->i;
+}
+
+/*
+ * Bit-width of a node from its operands, following the same rules as
+ * _printExpr().
+ */
+void ExprIR::_setwidth (expr_ir_node &n)
+{
+  int lw, rw;
+  int w = -1;
+
+  switch (n.type) {
+  case E_BUILTIN_BOOL:
+  case E_TRUE:
+  case E_FALSE:
+    w = 1;
+    break;
+
+  case E_BUILTIN_INT:
+    w = n.val;
+    break;
+
+  case E_QUERY:
+    lw = _nodes[n.op[1]].width;
+    rw = _nodes[n.op[2]].width;
+    if (lw > 0 && rw > 0) {
+      w = act_expr_bitwidth (n.type, lw, rw);
+    }
+    break;
+
+  case E_LT:
+  case E_GT:
+  case E_LE:
+  case E_GE:
+  case E_EQ:
+  case E_NE:
+  case E_AND:
+  case E_OR:
+  case E_DIV:
+  case E_MOD:
+  case E_LSR:
+  case E_ASR:
+  case E_XOR:
+  case E_PLUS:
+  case E_MINUS:
+  case E_MULT:
+  case E_LSL:
+    lw = _nodes[n.op[0]].width;
+    rw = _nodes[n.op[1]].width;
+    if (lw > 0 && rw > 0) {
+      w = act_expr_bitwidth (n.type, lw, rw);
+    }
+    break;
+
+  case E_NOT:
+  case E_COMPLEMENT:
+  case E_UMINUS:
+    lw = _nodes[n.op[0]].width;
+    if (lw > 0) {
+      w = act_expr_bitwidth (n.type, lw, 0);
+    }
+    break;
+
+  case E_INT:
+    if (n.leaf >= 0) {
+      w = 64;
+    }
+    else if (n.e->u.ival.v_extra) {
+      w = ((BigInt *) n.e->u.ival.v_extra)->getWidth();
+    }
+    else {
+      w = act_expr_intwidth (n.e->u.ival.v);
+    }
+    break;
+
+  case E_VAR:
+    w = _leaves[n.leaf].width;
+    break;
+
+  case E_CONCAT:
+    w = 0;
+    for (int i=0; i < n.op[1]; i++) {
+      lw = _nodes[_args[n.op[0]+i]].width;
+      if (lw < 0) {
+	w = -1;
+	break;
+      }
+      w += lw;
+    }
+    break;
+
+  case E_BITFIELD:
+    lw = _nodes[n.op[0]].width;
+    if (lw > 0) {
+      /* clip invalid bitfields; r > l means the value is zero */
+      if (n.val >= lw) {
+	n.val = lw - 1;
+      }
+      w = (n.val2 > n.val) ? 1 : (n.val - n.val2 + 1);
+    }
+    break;
+
+  default:
+    break;
+  }
+  n.width = w;
+  if (w < 0) {
+    _unknown_width++;
+  }
+}
+
+int ExprIR::add (Expr *e)
+{
+  phash_bucket_t *b;
+  ihash_bucket_t *ib;
+  int a[3];
+  int n;
+
+  b = phash_lookup (_emap, e);
+  if (b) {
+    return b->i;
+  }
+
+  switch (e->type) {
+  case E_LT:
+  case E_GT:
+  case E_LE:
+  case E_GE:
+  case E_EQ:
+  case E_NE:
+  case E_AND:
+  case E_OR:
+  case E_DIV:
+  case E_MOD:
+  case E_LSR:
+  case E_ASR:
+  case E_XOR:
+  case E_PLUS:
+  case E_MINUS:
+  case E_MULT:
+  case E_LSL:
+    a[0] = add (e->u.e.l);
+    a[1] = add (e->u.e.r);
+    n = _newnode (e->type, e);
+    _nodes[n].op[0] = a[0];
+    _nodes[n].op[1] = a[1];
+    break;
+
+  case E_NOT:
+  case E_COMPLEMENT:
+  case E_UMINUS:
+  case E_BUILTIN_BOOL:
+    a[0] = add (e->u.e.l);
+    n = _newnode (e->type, e);
+    _nodes[n].op[0] = a[0];
+    break;
+
+  case E_BUILTIN_INT:
+    {
+      long w = e->u.e.r ? e->u.e.r->u.ival.v : 1;
+      /* a zero-width int() does not look at its argument */
+      a[0] = (w == 0) ? -1 : add (e->u.e.l);
+      n = _newnode (e->type, e);
+      _nodes[n].op[0] = a[0];
+      _nodes[n].val = w;
+    }
+    break;
+
+  case E_QUERY:
+    a[0] = add (e->u.e.l);
+    a[1] = add (e->u.e.r->u.e.l);
+    a[2] = add (e->u.e.r->u.e.r);
+    n = _newnode (e->type, e);
+    for (int i=0; i < 3; i++) {
+      _nodes[n].op[i] = a[i];
+    }
+    break;
+
+  case E_CONCAT:
+    {
+      std::vector<int> tmp;
+      for (Expr *x = e; x; x = x->u.e.r) {
+	tmp.push_back (add (x->u.e.l));
+      }
+      n = _newnode (e->type, e);
+      _nodes[n].op[0] = _args.size();
+      _nodes[n].op[1] = tmp.size();
+      _args.insert (_args.end(), tmp.begin(), tmp.end());
+    }
+    break;
+
+  case E_BITFIELD:
+    a[0] = add (e->u.e.l);
+    n = _newnode (e->type, e);
+    _nodes[n].op[0] = a[0];
+    if (e->u.e.r->u.e.l) {
+      _nodes[n].val = (unsigned int) e->u.e.r->u.e.r->u.ival.v;
+      _nodes[n].val2 = (unsigned int) e->u.e.r->u.e.l->u.ival.v;
+    }
+    else {
+      _nodes[n].val = (unsigned int) e->u.e.r->u.e.r->u.ival.v;
+      _nodes[n].val2 = _nodes[n].val;
+    }
+    break;
+
+  case E_VAR:
+    ib = _leafmap ? ihash_lookup (_leafmap, (long) e) : NULL;
+    if (_leafmap) {
+      Assert (ib, "variable not found in variable map");
+    }
+    a[0] = _leaf (e, ib ? (const char *) ib->v : NULL);
+    n = _newnode (e->type, e);
+    _nodes[n].leaf = a[0];
+    break;
+
+  case E_INT:
+  case E_TRUE:
+  case E_FALSE:
+    ib = _leafmap ? ihash_lookup (_leafmap, (long) e) : NULL;
+    a[0] = ib ? _leaf (e, (const char *) ib->v) : -1;
+    n = _newnode (e->type, e);
+    _nodes[n].leaf = a[0];
+    if (e->type == E_INT) {
+      _nodes[n].val = e->u.ival.v;
+    }
+    break;
+
+  default:
+    fatal_error ("ExprIR: unsupported expression type %d", e->type);
+    break;
+  }
+  _setwidth (_nodes[n]);
+
+  b = phash_add (_emap, e);
+  b->i = n;
+  return n;
+}
+
+int ExprIR::addRoot (Expr *e, int width, const char *name)
+{
+  expr_ir_root r;
+  r.node = add (e);
+  r.width = width;
+  r.name = name;
+  _roots.push_back (r);
+  return r.node;
+}
+
+/*
+ * Add the constant fields of a node to a hash.
+ */
+void ExprIR::_hashconst (ExprHasher &h, expr_ir_node &n)
+{
+  if (n.type == E_INT && n.leaf < 0 && n.e->u.ival.v_extra) {
+    char *buf = NULL;
+    size_t sz = 0;
+    FILE *fp = open_memstream (&buf, &sz);
+    ((BigInt *) n.e->u.ival.v_extra)->bitPrint (fp);
+    fclose (fp);
+    h.add (buf, sz);
+    free (buf);
+  }
+  else {
+    h.add (n.val);
+    h.add (n.val2);
+  }
+}
+
+expr_hash ExprIR::hash ()
+{
+  ExprHasher h;
+
+  h.add ((long) _nodes.size());
+  for (auto &n : _nodes) {
+    h.add ((long) n.type);
+    h.add ((long) n.width);
+    h.add ((long) n.leaf);
+    if (n.type == E_CONCAT) {
+      h.add ((long) n.op[1]);
+      for (int i=0; i < n.op[1]; i++) {
+	h.add ((long) _args[n.op[0]+i]);
+      }
+    }
+    else {
+      h.add (n.op, sizeof (n.op));
+    }
+    _hashconst (h, n);
+  }
+  h.add ((long) _leaves.size());
+  for (auto &l : _leaves) {
+    h.add ((long) l.width);
+    h.add ((long) _nodes[l.node].type);
+  }
+  h.add ((long) _roots.size());
+  for (auto &r : _roots) {
+    h.add ((long) r.node);
+    h.add ((long) r.width);
+  }
+  return h.value();
+}
+
+static bool _commutative (int type)
+{
+  switch (type) {
+  case E_AND:
+  case E_OR:
+  case E_XOR:
+  case E_PLUS:
+  case E_MULT:
+  case E_EQ:
+  case E_NE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* the first byte hashed by canonicalHash() and functionHash(), so
+   that the inputs of the two kinds of hashes can never be the same */
+static const unsigned char _tag_struct = 'S';
+static const unsigned char _tag_func = 'F';
+
+static bool _hash_less (const expr_hash &a, const expr_hash &b)
+{
+  return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+expr_hash ExprIR::canonicalHash (std::vector<int> *perm)
+{
+  std::vector<expr_hash> shape (_nodes.size());
+  std::vector<int> order (_nodes.size(), -1);
+  std::vector<int> lorder (_leaves.size(), -1);
+  std::vector<int> lv;
+  int norder = 0;
+  ExprHasher h;
+
+  h.add (&_tag_struct, 1);
+
+  /* name-independent shape of each node; the array is in topological
+     order, so operands are always done first */
+  for (size_t i=0; i < _nodes.size(); i++) {
+    expr_ir_node &n = _nodes[i];
+    ExprHasher sh;
+    sh.add ((long) n.type);
+    sh.add ((long) n.width);
+    _hashconst (sh, n);
+    if (n.type == E_CONCAT) {
+      for (int j=0; j < n.op[1]; j++) {
+	sh.add (&shape[_args[n.op[0]+j]], sizeof (expr_hash));
+      }
+    }
+    else if (_commutative (n.type)
+	     && _hash_less (shape[n.op[1]], shape[n.op[0]])) {
+      sh.add (&shape[n.op[1]], sizeof (expr_hash));
+      sh.add (&shape[n.op[0]], sizeof (expr_hash));
+    }
+    else {
+      for (int j=0; j < 3; j++) {
+	if (n.op[j] >= 0) {
+	  sh.add (&shape[n.op[j]], sizeof (expr_hash));
+	}
+      }
+    }
+    shape[i] = sh.value();
+  }
+
+  /* canonical post-order walk from the roots; nodes and leaves are
+     numbered in the order they are reached */
+  std::function<void (int)> visit = [&] (int i) {
+    expr_ir_node &n = _nodes[i];
+    int ops[3];
+    int nops = 0;
+
+    if (order[i] >= 0) {
+      return;
+    }
+    if (n.type == E_CONCAT) {
+      for (int j=0; j < n.op[1]; j++) {
+	visit (_args[n.op[0]+j]);
+      }
+    }
+    else {
+      for (int j=0; j < 3; j++) {
+	if (n.op[j] >= 0) {
+	  ops[nops++] = n.op[j];
+	}
+      }
+      if (_commutative (n.type) && _hash_less (shape[ops[1]], shape[ops[0]])) {
+	std::swap (ops[0], ops[1]);
+      }
+      for (int j=0; j < nops; j++) {
+	visit (ops[j]);
+      }
+    }
+    if (n.leaf >= 0 && lorder[n.leaf] < 0) {
+      lorder[n.leaf] = lv.size();
+      lv.push_back (n.leaf);
+    }
+    order[i] = norder++;
+
+    h.add ((long) n.type);
+    h.add ((long) n.width);
+    h.add ((long) (n.leaf >= 0 ? lorder[n.leaf] : -1));
+    _hashconst (h, n);
+    if (n.type == E_CONCAT) {
+      h.add ((long) n.op[1]);
+      for (int j=0; j < n.op[1]; j++) {
+	h.add ((long) order[_args[n.op[0]+j]]);
+      }
+    }
+    else {
+      for (int j=0; j < nops; j++) {
+	h.add ((long) order[ops[j]]);
+      }
+    }
+  };
+
+  for (auto &r : _roots) {
+    visit (r.node);
+  }
+
+  h.add ((long) lv.size());
+  for (auto l : lv) {
+    h.add ((long) _leaves[l].width);
+    h.add ((long) _nodes[_leaves[l].node].type);
+  }
+  if (perm) {
+    *perm = lv;
+  }
+  h.add ((long) _roots.size());
+  for (auto &r : _roots) {
+    h.add ((long) order[r.node]);
+    h.add ((long) r.width);
+  }
+  return h.value();
+}
+
+/*
+ * Declare a fresh temporary of width w, and start its assignment.
+ */
+static int _decl (FILE *fp, const char *prefix, int *idx, int w)
+{
+  int res = *idx;
+  *idx = *idx + 1;
+  if (w == 1 || w == 0) {
+    fprintf (fp, "\twire %s%d;\n", prefix, res);
+  }
+  else {
+    fprintf (fp, "\twire [%d:0] %s%d;\n", w-1, prefix, res);
+  }
+  fprintf (fp, "\tassign %s%d = ", prefix, res);
+  return res;
+}
+
+/*
+ * Zero-extend or truncate temporary t of width w to width resw.
+ */
+static int _pad (FILE *fp, const char *prefix, int *idx,
+		 int t, int w, int resw)
+{
+  int res = _decl (fp, prefix, idx, resw);
+  if (w < resw) {
+    fprintf (fp, "{%d'b", resw-w);
+    for (int i=0; i < resw-w; i++) {
+      fprintf (fp, "0");
+    }
+    fprintf (fp, ",%s%d};\n", prefix, t);
+  }
+  else if (w > resw) {
+    fprintf (fp, "%s%d[%d:0];\n", prefix, t, resw-1);
+  }
+  else {
+    fprintf (fp, "%s%d;\n", prefix, t);
+  }
+  return res;
+}
+
+static const char *_opstr (int type)
+{
+  switch (type) {
+  case E_AND: return "&";
+  case E_OR: return "|";
+  case E_XOR: return "^";
+  case E_DIV: return "/";
+  case E_MOD: return "%";
+  case E_LSR: return ">>";
+  case E_ASR: return ">>>";
+  case E_LT: return "<";
+  case E_GT: return ">";
+  case E_LE: return "<=";
+  case E_GE: return ">=";
+  case E_EQ: return "==";
+  case E_NE: return "!=";
+  case E_PLUS: return "+";
+  case E_MINUS: return "-";
+  case E_MULT: return "*";
+  case E_LSL: return "<<";
+  default: return "??";
+  }
+}
+
+void ExprIR::printVerilog (FILE *fp, const char *prefix, int *idx,
+			   std::vector<int> &tmp, int upto)
+{
+  int res, l, r;
+
+  if (upto < 0) {
+    upto = _nodes.size()-1;
+  }
+
+  for (int i=tmp.size(); i <= upto; i++) {
+    expr_ir_node &n = _nodes[i];
+    const char *nm = (n.leaf >= 0) ? _leaves[n.leaf].name : NULL;
+
+    if (n.width < 0) {
+      if (n.type == E_VAR) {
+	fatal_error ("Could not find bitwidth for variable %s!\n",
+		     nm ? nm : "??");
+      }
+      fatal_error ("ExprIR: unknown bitwidth for expression");
+    }
+
+    switch (n.type) {
+    case E_BUILTIN_BOOL:
+      res = _decl (fp, prefix, idx, 1);
+      fprintf (fp, "%s%d != 0", prefix, tmp[n.op[0]]);
+      break;
+
+    case E_BUILTIN_INT:
+      res = _decl (fp, prefix, idx, n.width);
+      if (n.width == 0) {
+	fprintf (fp, "0");
+      }
+      else {
+	fprintf (fp, "%s%d", prefix, tmp[n.op[0]]);
+      }
+      break;
+
+    case E_QUERY:
+      res = _decl (fp, prefix, idx, n.width);
+      fprintf (fp, " %s%d ? ", prefix, tmp[n.op[0]]);
+      fprintf (fp, " %s%d : ", prefix, tmp[n.op[1]]);
+      fprintf (fp, " %s%d", prefix, tmp[n.op[2]]);
+      break;
+
+    case E_LT:
+    case E_GT:
+    case E_LE:
+    case E_GE:
+    case E_EQ:
+    case E_NE:
+    case E_AND:
+    case E_OR:
+    case E_DIV:
+    case E_MOD:
+    case E_LSR:
+    case E_ASR:
+    case E_XOR:
+      res = _decl (fp, prefix, idx, n.width);
+      fprintf (fp, "%s%d %s %s%d", prefix, tmp[n.op[0]], _opstr (n.type),
+	       prefix, tmp[n.op[1]]);
+      break;
+
+    case E_NOT:
+    case E_COMPLEMENT:
+    case E_UMINUS:
+      res = _decl (fp, prefix, idx, n.width);
+      fprintf (fp, "%s%s%d", n.type == E_UMINUS ? "-" : "~",
+	       prefix, tmp[n.op[0]]);
+      break;
+
+      /* operands are padded to the result width */
+    case E_PLUS:
+    case E_MINUS:
+    case E_MULT:
+    case E_LSL:
+      l = _pad (fp, prefix, idx, tmp[n.op[0]], _nodes[n.op[0]].width,
+		n.width);
+      r = _pad (fp, prefix, idx, tmp[n.op[1]], _nodes[n.op[1]].width,
+		n.width);
+      res = _decl (fp, prefix, idx, n.width);
+      fprintf (fp, "%s%d %s %s%d", prefix, l, _opstr (n.type), prefix, r);
+      break;
+
+    case E_INT:
+      res = _decl (fp, prefix, idx, n.width);
+      if (nm) {
+	fprintf (fp, "%s", nm);
+	warning ("Int bitwidth unspecified");
+      }
+      else if (n.width == 0) {
+	fprintf (fp, "1'b0");
+      }
+      else if (n.e->u.ival.v_extra) {
+	fprintf (fp, "%d'b", n.width);
+	((BigInt *) n.e->u.ival.v_extra)->bitPrint (fp);
+      }
+      else {
+	fprintf (fp, "%d'h%lx", n.width, n.val);
+      }
+      break;
+
+    case E_VAR:
+      res = _decl (fp, prefix, idx, n.width);
+      if (nm) {
+	fprintf (fp, "%s", nm);
+      }
+      else {
+	ActId *id = _leaves[n.leaf].id;
+	if (id->isDynamicDeref()) {
+	  fatal_error ("ExprIR: dynamic array references need a leaf map");
+	}
+	fprintf (fp, "\\");
+	id->Print (fp);
+	fprintf (fp, " ");
+      }
+      break;
+
+    case E_TRUE:
+    case E_FALSE:
+      res = _decl (fp, prefix, idx, 1);
+      if (nm) {
+	fprintf (fp, "%s", nm);
+      }
+      else {
+	fprintf (fp, n.type == E_TRUE ? " 1'b1 " : " 1'b0 ");
+      }
+      break;
+
+    case E_CONCAT:
+      res = _decl (fp, prefix, idx, n.width);
+      if (n.width == 0) {
+	fprintf (fp, "0");
+      }
+      else {
+	bool first = true;
+	fprintf (fp, "{");
+	for (int j=0; j < n.op[1]; j++) {
+	  int a = _args[n.op[0]+j];
+	  if (_nodes[a].width > 0) {
+	    fprintf (fp, "%s%s%d", first ? "" : ", ", prefix, tmp[a]);
+	    first = false;
+	  }
+	}
+	fprintf (fp, "}");
+      }
+      break;
+
+    case E_BITFIELD:
+      res = _decl (fp, prefix, idx, n.width);
+      if (n.val2 > n.val) {
+	fprintf (fp, "1'b0");
+      }
+      else if (n.val != n.val2) {
+	fprintf (fp, "%s%d [%ld:%ld]", prefix, tmp[n.op[0]], n.val, n.val2);
+      }
+      else {
+	fprintf (fp, "%s%d [%ld]", prefix, tmp[n.op[0]], n.val2);
+      }
+      break;
+
+    default:
+      fatal_error ("ExprIR: unsupported expression type %d", n.type);
+      break;
+    }
+    fprintf (fp, ";\n");
+    tmp.push_back (res);
+  }
+}
+
+static inline unsigned long long _mask (int w)
+{
+  return (w >= 64) ? ~0ULL : ((1ULL << w) - 1);
+}
+
+bool ExprIR::eval (const unsigned long long *leafval,
+		   std::vector<unsigned long long> &val)
+{
+  unsigned long long a, b, c, v;
+
+  val.resize (_nodes.size());
+  for (size_t i=0; i < _nodes.size(); i++) {
+    expr_ir_node &n = _nodes[i];
+    if (n.width < 0 || n.width > 64) {
+      return false;
+    }
+    a = (n.op[0] >= 0 && n.type != E_CONCAT) ? val[n.op[0]] : 0;
+    b = (n.op[1] >= 0 && n.type != E_CONCAT) ? val[n.op[1]] : 0;
+    c = (n.op[2] >= 0) ? val[n.op[2]] : 0;
+
+    switch (n.type) {
+    case E_AND: v = a & b; break;
+    case E_OR: v = a | b; break;
+    case E_XOR: v = a ^ b; break;
+    case E_PLUS: v = a + b; break;
+    case E_MINUS: v = a - b; break;
+    case E_MULT: v = a * b; break;
+    case E_DIV:
+    case E_MOD:
+      if (b == 0) {
+	return false;
+      }
+      v = (n.type == E_DIV) ? a / b : a % b;
+      break;
+    case E_LSL: v = (b >= 64) ? 0 : (a << b); break;
+    case E_LSR:
+    case E_ASR:
+      /* all values are unsigned, so >>> is a logical shift */
+      v = (b >= 64) ? 0 : (a >> b);
+      break;
+    case E_LT: v = (a < b); break;
+    case E_GT: v = (a > b); break;
+    case E_LE: v = (a <= b); break;
+    case E_GE: v = (a >= b); break;
+    case E_EQ: v = (a == b); break;
+    case E_NE: v = (a != b); break;
+    case E_NOT:
+    case E_COMPLEMENT: v = ~a; break;
+    case E_UMINUS: v = -a; break;
+    case E_QUERY: v = a ? b : c; break;
+    case E_BUILTIN_BOOL: v = (a != 0); break;
+    case E_BUILTIN_INT: v = a; break;
+
+    case E_INT:
+      if (n.leaf >= 0) {
+	v = leafval[n.leaf];
+      }
+      else if (n.e->u.ival.v_extra) {
+	return false;
+      }
+      else {
+	v = n.val;
+      }
+      break;
+    case E_VAR: v = leafval[n.leaf]; break;
+    case E_TRUE:
+    case E_FALSE:
+      v = (n.leaf >= 0) ? leafval[n.leaf] : (n.type == E_TRUE);
+      break;
+
+    case E_CONCAT:
+      v = 0;
+      for (int j=0; j < n.op[1]; j++) {
+	int x = _args[n.op[0]+j];
+	if (_nodes[x].width > 0) {
+	  v = (_nodes[x].width >= 64) ? val[x] : ((v << _nodes[x].width) | val[x]);
+	}
+      }
+      break;
+
+    case E_BITFIELD:
+      v = (n.val2 > n.val) ? 0 : (a >> n.val2);
+      break;
+
+    default:
+      return false;
+    }
+    val[i] = v & _mask (n.width);
+  }
+  return true;
+}
+
+bool ExprIR::eval (const unsigned long long *leafval, int n,
+		   std::vector<unsigned long long> &val)
+{
+  const unsigned long long *a, *b, *c;
+  unsigned long long *v;
+
+#define LANES(x)				\
+  do {						\
+    for (int k=0; k < n; k++) {			\
+      v[k] = (x);				\
+    }						\
+  } while (0)
+
+  val.resize (_nodes.size() * n);
+  for (size_t i=0; i < _nodes.size(); i++) {
+    expr_ir_node &nd = _nodes[i];
+    if (nd.width < 0 || nd.width > 64) {
+      return false;
+    }
+    v = &val[i*n];
+    a = (nd.op[0] >= 0 && nd.type != E_CONCAT) ? &val[nd.op[0]*n] : NULL;
+    b = (nd.op[1] >= 0 && nd.type != E_CONCAT) ? &val[nd.op[1]*n] : NULL;
+    c = (nd.op[2] >= 0) ? &val[nd.op[2]*n] : NULL;
+
+    switch (nd.type) {
+    case E_AND: LANES (a[k] & b[k]); break;
+    case E_OR: LANES (a[k] | b[k]); break;
+    case E_XOR: LANES (a[k] ^ b[k]); break;
+    case E_PLUS: LANES (a[k] + b[k]); break;
+    case E_MINUS: LANES (a[k] - b[k]); break;
+    case E_MULT: LANES (a[k] * b[k]); break;
+    case E_DIV:
+    case E_MOD:
+      for (int k=0; k < n; k++) {
+	if (b[k] == 0) {
+	  return false;
+	}
+      }
+      if (nd.type == E_DIV) {
+	LANES (a[k] / b[k]);
+      }
+      else {
+	LANES (a[k] % b[k]);
+      }
+      break;
+    case E_LSL: LANES ((b[k] >= 64) ? 0 : (a[k] << b[k])); break;
+    case E_LSR:
+    case E_ASR:
+      /* all values are unsigned, so >>> is a logical shift */
+      LANES ((b[k] >= 64) ? 0 : (a[k] >> b[k]));
+      break;
+    case E_LT: LANES (a[k] < b[k]); break;
+    case E_GT: LANES (a[k] > b[k]); break;
+    case E_LE: LANES (a[k] <= b[k]); break;
+    case E_GE: LANES (a[k] >= b[k]); break;
+    case E_EQ: LANES (a[k] == b[k]); break;
+    case E_NE: LANES (a[k] != b[k]); break;
+    case E_NOT:
+    case E_COMPLEMENT: LANES (~a[k]); break;
+    case E_UMINUS: LANES (-a[k]); break;
+    case E_QUERY: LANES (a[k] ? b[k] : c[k]); break;
+    case E_BUILTIN_BOOL: LANES (a[k] != 0); break;
+    case E_BUILTIN_INT: LANES (a[k]); break;
+
+    case E_INT:
+      if (nd.leaf >= 0) {
+	const unsigned long long *l = &leafval[nd.leaf*n];
+	LANES (l[k]);
+      }
+      else if (nd.e->u.ival.v_extra) {
+	return false;
+      }
+      else {
+	LANES ((unsigned long long) nd.val);
+      }
+      break;
+    case E_VAR:
+      {
+	const unsigned long long *l = &leafval[nd.leaf*n];
+	LANES (l[k]);
+      }
+      break;
+    case E_TRUE:
+    case E_FALSE:
+      if (nd.leaf >= 0) {
+	const unsigned long long *l = &leafval[nd.leaf*n];
+	LANES (l[k]);
+      }
+      else {
+	LANES ((unsigned long long) (nd.type == E_TRUE));
+      }
+      break;
+
+    case E_CONCAT:
+      LANES (0);
+      for (int j=0; j < nd.op[1]; j++) {
+	int x = _args[nd.op[0]+j];
+	int w = _nodes[x].width;
+	const unsigned long long *ax = &val[x*n];
+	if (w >= 64) {
+	  LANES (ax[k]);
+	}
+	else if (w > 0) {
+	  LANES ((v[k] << w) | ax[k]);
+	}
+      }
+      break;
+
+    case E_BITFIELD:
+      if (nd.val2 > nd.val) {
+	LANES (0);
+      }
+      else {
+	LANES (a[k] >> nd.val2);
+      }
+      break;
+
+    default:
+      return false;
+    }
+    unsigned long long m = _mask (nd.width);
+    LANES (v[k] & m);
+  }
+#undef LANES
+  return true;
+}
+
+bool ExprIR::functionHash (int maxbits, const std::vector<int> &start,
+			   expr_hash *h, std::vector<int> *perm)
+{
+  const int lanes = 64;
+  int nl = _leaves.size();
+  int nr = _roots.size();
+  int bits = 0;
+
+  if (nl == 0 || nr == 0 || (int) start.size() != nl || maxbits > 24) {
+    return false;
+  }
+  for (auto &l : _leaves) {
+    if (l.width <= 0 || l.width > maxbits) {
+      return false;
+    }
+    bits += l.width;
+  }
+  if (bits > maxbits) {
+    return false;
+  }
+
+  /* leaf start[j] is at bit off[start[j]] of the table index */
+  std::vector<int> off (nl);
+  for (int j=0, o=0; j < nl; j++) {
+    off[start[j]] = o;
+    o += _leaves[start[j]].width;
+  }
+
+  /* the table of every root; lanes of consecutive indices are
+     evaluated together */
+  unsigned long long total = 1ULL << bits;
+  std::vector<unsigned long long> tt (total * nr);
+  std::vector<unsigned long long> lv (nl * lanes);
+  std::vector<unsigned long long> val;
+  for (unsigned long long x=0; x < total; x += lanes) {
+    int n = (total - x < (unsigned long long) lanes) ? (total - x) : lanes;
+    for (int l=0; l < nl; l++) {
+      unsigned long long m = _mask (_leaves[l].width);
+      for (int k=0; k < n; k++) {
+	lv[l*n+k] = ((x+k) >> off[l]) & m;
+      }
+    }
+    if (!eval (lv.data(), n, val)) {
+      return false;
+    }
+    for (int r=0; r < nr; r++) {
+      int w = _roots[r].width;
+      unsigned long long m = _mask ((w < 0 || w > 64) ? 64 : w);
+      const unsigned long long *rv = &val[_roots[r].node*n];
+      for (int k=0; k < n; k++) {
+	tt[r*total + x+k] = rv[k] & m;
+      }
+    }
+  }
+
+  /* signature of a leaf: for each root and each value of the leaf,
+     the number of one bits of the root over all the values of the
+     other leaves. It only depends on where the leaf is used. */
+  std::vector<expr_hash> sig (nl);
+  for (int l=0; l < nl; l++) {
+    unsigned long long nv = 1ULL << _leaves[l].width;
+    unsigned long long m = nv - 1;
+    std::vector<unsigned long long> ones (nv * nr, 0);
+    for (int r=0; r < nr; r++) {
+      for (unsigned long long x=0; x < total; x++) {
+	ones[r*nv + ((x >> off[l]) & m)] += __builtin_popcountll (tt[r*total+x]);
+      }
+    }
+    ExprHasher sh;
+    sh.add (ones.data(), ones.size() * sizeof (unsigned long long));
+    sig[l] = sh.value();
+  }
+
+  std::vector<int> pos (nl);
+  for (int j=0; j < nl; j++) {
+    pos[j] = j;
+  }
+  std::sort (pos.begin(), pos.end(), [&] (int i, int j) {
+      int a = start[i], b = start[j];
+      if (_leaves[a].width != _leaves[b].width) {
+	return _leaves[a].width < _leaves[b].width;
+      }
+      if (sig[a] != sig[b]) {
+	return _hash_less (sig[a], sig[b]);
+      }
+      return i < j;
+    });
+  perm->resize (nl);
+  for (int j=0; j < nl; j++) {
+    (*perm)[j] = start[pos[j]];
+  }
+
+  /* the tables in the canonical order: canonical index y is index x
+     in the order above */
+  std::vector<int> noff (nl);
+  for (int j=0, o=0; j < nl; j++) {
+    noff[(*perm)[j]] = o;
+    o += _leaves[(*perm)[j]].width;
+  }
+  std::vector<unsigned long long> ctt (total);
+  ExprHasher fh;
+  fh.add (&_tag_func, 1);
+  fh.add ((long) nl);
+  for (int j=0; j < nl; j++) {
+    fh.add ((long) _leaves[(*perm)[j]].width);
+  }
+  fh.add ((long) nr);
+  for (int r=0; r < nr; r++) {
+    fh.add ((long) _roots[r].width);
+    fh.add ((long) _nodes[_roots[r].node].width);
+    for (unsigned long long y=0; y < total; y++) {
+      unsigned long long x = 0;
+      for (int l=0; l < nl; l++) {
+	x |= ((y >> noff[l]) & _mask (_leaves[l].width)) << off[l];
+      }
+      ctt[y] = tt[r*total + x];
+    }
+    fh.add (ctt.data(), ctt.size() * sizeof (unsigned long long));
+  }
+  *h = fh.value();
+  return true;
+}
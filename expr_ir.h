@@ -0,0 +1,206 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************/
+#ifndef __EXPR_IR_H__
+#define __EXPR_IR_H__
+
+#include <vector>
+#include <functional>
+#include "expr_info.h"
+#include "expr_hash.h"
+
+/*
+ * A node of the flattened expression. Operands always refer to nodes
+ * that appear earlier in the node array.
+ */
+struct expr_ir_node {
+  int type;		//< E_xxx expression type
+  int width;		//< bit-width, -1 if unknown
+  int op[3];		//< operand node indices (-1 = unused). For
+			//< E_QUERY: cond, true, false. For E_CONCAT:
+			//< op[0] = start in concat arg array, op[1] =
+			//< count
+  int leaf;		//< leaf index for E_VAR and mapped constants, else -1
+  long val;		//< E_INT value; E_BITFIELD msb; E_BUILTIN_INT width
+  long val2;		//< E_BITFIELD lsb
+  Expr *e;		//< source expression
+};
+
+/*
+ * A distinct leaf (variable) of the flattened expression. Leaves with
+ * the same name (or, without a leaf map, the same ActId) are merged.
+ */
+struct expr_ir_leaf {
+  const char *name;	//< name from the leaf map, or NULL
+  ActId *id;		//< id for E_VAR leaves without a leaf map
+  int width;		//< bit-width
+  int node;		//< first node that uses this leaf
+};
+
+/*
+ * An output of the flattened block.
+ */
+struct expr_ir_root {
+  int node;		//< node index
+  int width;		//< requested width of the output, -1 if none
+  const char *name;	//< output name (or NULL)
+};
+
+/**
+ * ExprIR: a compact, flat representation of a block of expressions.
+ *
+ * The expressions are converted once into a contiguous array of
+ * nodes in topological (post-order) order, with bit-widths, operand
+ * indices and leaf information stored inline. Shared sub-expressions
+ * are converted once. After conversion, analysis passes (hashing,
+ * emission, simulation) are linear scans over the node array, and
+ * no longer need per-node hash table lookups.
+ *
+ * An ExprIR can be cleared and reused; the arrays keep their
+ * allocated storage.
+ */
+class ExprIR {
+public:
+  /*
+   * Returns the width of an E_VAR leaf. The name is the one from the
+   * leaf map (or NULL if there is no leaf map). Return -1 if unknown.
+   */
+  typedef std::function<int (Expr *, const char *)> leaf_width_fn;
+
+  ExprIR ();
+  ~ExprIR ();
+
+  /*
+   * Set the leaf map (Expr * -> char * names; may be NULL) and the
+   * width function for variables. Must be called before add().
+   */
+  void setLeafInfo (iHashtable *leafmap, leaf_width_fn fn);
+
+  /* reset to empty, keeping storage */
+  void clear ();
+
+  /* convert an expression; returns its node index */
+  int add (Expr *e);
+
+  /* convert an expression and mark it as an output */
+  int addRoot (Expr *e, int width = -1, const char *name = NULL);
+
+  int numNodes () { return _nodes.size(); }
+  expr_ir_node &node (int i) { return _nodes[i]; }
+  int concatArg (int i) { return _args[i]; }
+
+  int numLeaves () { return _leaves.size(); }
+  expr_ir_leaf &leaf (int i) { return _leaves[i]; }
+
+  int numRoots () { return _roots.size(); }
+  expr_ir_root &root (int i) { return _roots[i]; }
+
+  /* true if every node has a known width */
+  bool widthsKnown () { return _unknown_width == 0; }
+
+  /**
+   * Structural hash of the block: nodes, leaf widths and outputs.
+   * Leaves are identified by their index, so the hash is independent
+   * of leaf names.
+   */
+  expr_hash hash ();
+
+  /**
+   * Hash of a canonical form of the block. Operands of commutative
+   * operators are put in the order of a structural hash that ignores
+   * leaf identity, and leaves are then numbered by first occurrence.
+   * Blocks that only differ in the names of their leaves or in the
+   * operand order of commutative operators have the same canonical
+   * hash. If perm is not NULL, (*perm)[i] is set to the leaf that is
+   * canonical leaf i.
+   */
+  expr_hash canonicalHash (std::vector<int> *perm = NULL);
+
+  /**
+   * Print Verilog wire declarations and assignments with the same
+   * conventions as ExternalExprOpt::_printExpr(). Nodes from
+   * tmp.size() up to and including node upto (default: all nodes)
+   * are printed, and tmp[i] is set to the temporary index used for
+   * node i. Temporaries are named prefix<n>, starting from *idx.
+   */
+  void printVerilog (FILE *fp, const char *prefix, int *idx,
+		     std::vector<int> &tmp, int upto = -1);
+
+  /**
+   * Evaluate the block. leafval[i] is the value of leaf i, and on
+   * return val[i] holds the value of node i. Returns false if the
+   * block cannot be simulated with 64-bit values (wide nodes, big
+   * integers, division by zero).
+   */
+  bool eval (const unsigned long long *leafval,
+	     std::vector<unsigned long long> &val);
+
+  /**
+   * Evaluate the block for n sets of leaf values at once:
+   * leafval[l*n+k] is the value of leaf l in set k, and on return
+   * val[i*n+k] holds the value of node i in set k. Each node is a
+   * loop over the sets, which the compiler can vectorize. Returns
+   * false if eval() would for one of the sets.
+   */
+  bool eval (const unsigned long long *leafval, int n,
+	     std::vector<unsigned long long> &val);
+
+  /**
+   * Hash of the function the block computes: the truth tables of its
+   * roots over all values of the leaves, if the leaves have at most
+   * maxbits bits in all. Leaves are put in a canonical order: by
+   * width, and then by a signature of the truth tables that does not
+   * depend on the order of the leaves, so that blocks that compute the
+   * same function of permuted inputs of the same width mostly get the
+   * same hash. Ties are broken by the leaf order in start (e.g. the
+   * one from canonicalHash()). (*perm)[i] is set to the leaf that is
+   * canonical leaf i. Returns false if the block is too wide or
+   * cannot be evaluated.
+   *
+   * Only permutations of the leaves are canonicalized; blocks that
+   * differ by negated inputs or outputs (NPN equivalence) get
+   * different hashes. maxbits above 24 always returns false, since
+   * the tables would be too large. The hash cannot be the same as a
+   * canonicalHash() of any block.
+   */
+  bool functionHash (int maxbits, const std::vector<int> &start,
+		     expr_hash *h, std::vector<int> *perm);
+
+private:
+  std::vector<expr_ir_node> _nodes;
+  std::vector<expr_ir_leaf> _leaves;
+  std::vector<expr_ir_root> _roots;
+  std::vector<int> _args;	// E_CONCAT operands
+
+  int _unknown_width;
+
+  iHashtable *_leafmap;
+  leaf_width_fn _leafwidth;
+
+  pHashtable *_emap;		// Expr * -> node, only during conversion
+  struct Hashtable *_lnames;	// leaf name -> leaf
+
+  int _newnode (int type, Expr *e);
+  void _hashconst (ExprHasher &h, expr_ir_node &n);
+  int _leaf (Expr *e, const char *name);
+  void _setwidth (expr_ir_node &n);
+};
+
+#endif /* __EXPR_IR_H__ */
@@ -21,6 +21,7 @@
 
 #include "expropt.h"
 #include "abc_api.h"
+#include <unistd.h>
 
 #define VERILOG_FILE_PREFIX "exprop_"
 #define MAPPED_FILE_SUFFIX "_mapped"
@@ -73,6 +74,15 @@ void ExternalExprOpt::_init_defaults ()
   // verbosity level. 1 = display dots
   config_set_default_int ("synth.expropt.verbose", 1);
 
+  // emit Verilog that only depends on the expressions and port names
+  config_set_default_int ("synth.expropt.canonical_verilog", 0);
+
+  // rebuild long +, &, |, ^ chains as balanced trees; multi-operand
+  // additions use carry-save adders. Off by default, since this
+  // changes the generated netlists
+  config_set_default_int ("synth.expropt.reassociate", 0);
+  config_set_default_int ("synth.expropt.carry_save_adders", 0);
+
   // namespace for the cell library for qdi and bundled data datapaths
   config_set_default_string ("synth.qdi.cell_lib_namespace", "syn");
   config_set_default_string ("synth.bundled.cell_lib_namespace", "syn");
@@ -95,6 +105,34 @@ void ExternalExprOpt::_init_defaults ()
   // default load cap
   config_set_default_real ("synth.expropt.default_load", 1.0);
 
+  // expression cache: rebuild the binary index snapshot once this
+  // many records have been appended to the journal after it
+  config_set_default_int ("synth.expropt.cache.index_rebuild", 256);
+
+  // also record the full expression string of every new cache entry
+  // in expr.keys
+  config_set_default_int ("synth.expropt.cache.debug_keys", 0);
+
+  // seconds after which the in-progress marker of a cache miss is
+  // taken to be from a process that died
+  config_set_default_int ("synth.expropt.cache.inprogress_timeout", 3600);
+
+  // cache budget: number of entries, and size in MB; 0 = no limit
+  config_set_default_int ("synth.expropt.cache.max_entries", 0);
+  config_set_default_int ("synth.expropt.cache.max_size", 0);
+
+  // write the cache hit/miss statistics of the run (JSON) to this
+  // file; empty = none
+  config_set_default_string ("synth.expropt.cache.stats_file", "");
+
+  // abc only: keep the optimized AIG of every cache miss, so that a
+  // miss for another library or technology only runs the mapping
+  config_set_default_int ("synth.expropt.cache.aig", 1);
+
+  // expressions with at most this many input bits are keyed by their
+  // truth table; 0 = structural keys only
+  config_set_default_int ("synth.expropt.cache.function_bits", 16);
+
   config_read("expropt.conf");
 
   _syn_dlib = NULL;
@@ -311,6 +349,10 @@ ExprBlockInfo* ExternalExprOpt::run_external_opt (std::string expr_set_name,
   std::string verilog_file = "./";
   verilog_file.append(VERILOG_FILE_PREFIX);
   //verilog_file.append(expr_set_name);
+  /* the pid keeps processes that share a directory (and a cache)
+     from clobbering each other's files */
+  verilog_file.append (std::to_string (getpid ()));
+  verilog_file.append ("_");
   verilog_file.append (std::to_string (_filenum++));
   
   std::string mapped_file = verilog_file;
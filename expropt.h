@@ -27,10 +27,43 @@
 #include <unordered_map>
 // #include <act/expr_info.h>
 #include "expr_info.h"
+#include "expr_hash.h"
 #include <string.h>
 
 static const int char_buf_sz = 1024*32;
 
+/**
+ * Reusable state for printExpr() calls on expressions from the same
+ * Scope. Identifier bit-widths are looked up in the scope once and
+ * cached, and the tables used while printing an expression are
+ * reused across calls.
+ */
+class ExprPrintContext {
+public:
+  ExprPrintContext (Scope *sc);
+  ~ExprPrintContext ();
+
+  Scope *getScope () { return _sc; }
+
+  /**
+   * Bit-width of an identifier in the scope (cached)
+   */
+  int idWidth (ActId *id);
+
+  /**
+   * Forget all cached widths; needed if the scope is modified.
+   */
+  void clear ();
+
+private:
+  friend class ExternalExprOpt;
+
+  Scope *_sc;
+  struct Hashtable *_namew;	//< identifier name -> bit-width
+  struct pHashtable *_emap;	//< per-expression temporaries
+  struct pHashtable *_wmap;	//< per-expression widths
+};
+
 /**
  * ExternalExprOpt is an interface that wrapps the synthesis, optimisation and mapping to cells of a set of act expr.
  * it will also give you metadata back if the software supports it. 
@@ -93,6 +126,8 @@ public:
     
     _cleanup = config_get_int("synth.expropt.clean_tmp_files");
 
+    _canonical = (config_get_int("synth.expropt.canonical_verilog") != 0);
+
     _abc_api = NULL;
   }
 
@@ -103,6 +138,35 @@ public:
   // return true if the synthesis engine specified exists
   static bool engineExists (const char *name);
 
+  /**
+   * Canonical Verilog emission. When enabled, the generated Verilog
+   * only depends on the expressions and the port names: hidden wires
+   * and assignments are emitted in name order, and temporaries are
+   * numbered sequentially. Ports keep the order they are given in,
+   * so the generated ACT process is unchanged.
+   *
+   * Defaults to synth.expropt.canonical_verilog
+   */
+  void set_canonical_verilog (bool v) { _canonical = v; }
+  bool is_canonical_verilog () { return _canonical; }
+
+  /**
+   * Returns a 128-bit hash (as a hex string) of the canonical Verilog
+   * for the expression set, with the ports sorted by name. The module
+   * name is not part of the hash, so two logically identical blocks
+   * with the same port names get the same signature, whatever order
+   * the ports are listed in. Arguments are the same as the general
+   * C-STRING MODE run_external_opt().
+   */
+  std::string verilog_signature (list_t *in_expr_list,
+				 iHashtable *in_expr_map,
+				 iHashtable *in_width_map,
+				 list_t *out_expr_list,
+				 list_t *out_expr_name_list,
+				 iHashtable *out_width_map,
+				 list_t *hidden_expr_list = NULL,
+				 list_t *hidden_expr_name_list = NULL);
+
   /**
    *  The common steps for the external expression optimizer are:
    *
@@ -363,13 +427,30 @@ protected:
    * as the start index for temp var name generation
    * @param leafmap is a map from leaf nodes (E_VAR/E_INT) to strings
    * to be printed
+   * @param canonical if true, temporary names are prefix(idx),
+   * prefix(idx+1), ... independent of the names in the scope. The
+   * scope is then only used for bit-widths, and the caller must pick
+   * a prefix that does not conflict with the scope.
    * @return the index for prefix(idx) which holds the expression value.
    */
   static int printExpr (FILE *fp, Expr *e,
 			Scope *sc,
 			const char *prefix,
 			int *idx,
-			iHashtable *leafmap);
+			iHashtable *leafmap,
+			bool canonical = false);
+
+  /**
+   * Same as above, but uses a print context that is shared across
+   * calls for the same scope. Use this when printing many
+   * expressions from the same scope.
+   */
+  static int printExpr (FILE *fp, Expr *e,
+			ExprPrintContext *ctx,
+			const char *prefix,
+			int *idx,
+			iHashtable *leafmap,
+			bool canonical = false);
 
     /**
      * the output file name where all act results are appended too.
@@ -424,10 +505,15 @@ protected:
      */
     const expr_mapping_target wire_encoding;
 
+    /**
+     * emit canonical Verilog (see set_canonical_verilog())
+     */
+    bool _canonical;
 
     int _filenum;
 
-  /* internal helper function for printExpr() */
+  /* internal helper function for printExpr(); sc is only used to
+     pick fresh temporary names, and may be NULL */
   static int _printExpr (FILE *fp, Expr *e, Scope *sc,
 			 const char *prefix, int *idx,
 			 pHashtable *emap,
@@ -0,0 +1,152 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************
+ */
+#include "cache_test.h"
+#include "expr_cache_archive.h"
+
+/*
+    Tests of cache archives (export, lookup, and import), and of
+    publishing a local cache to a global one.
+*/
+
+/* a cache with n entries; entry 0 has lost its unmapped netlist */
+static std::vector<expr_cache_record> make_cache (const std::string &dir, int n)
+{
+    std::vector<expr_cache_record> recs = {};
+    for (int i=0; i<n; i++) {
+        recs.push_back (test_record (i, 10 * i));
+        test_add_entry (dir, recs.back());
+    }
+    fs::remove (dir + "/" + test_loc (recs[0]) + "pre.v");
+    return recs;
+}
+
+static void check_entry (const std::string &dir, const expr_cache_record &rec)
+{
+    std::string loc = dir + "/" + expr_cache_key_path (rec.key());
+    CHECK (read_file (loc + ".v") == test_netlist (rec, false));
+    CHECK (read_file (loc + "pre.v") == test_netlist (rec, true));
+}
+
+static void test_round_trip ()
+{
+    std::string dir = test_dir ("carc");
+    std::string src = dir + "/src", dst = dir + "/dst";
+    std::string arc_fn = dir + "/cache.carc";
+    std::vector<expr_cache_record> recs = make_cache (src, 12);
+
+    uint64_t n, added, skipped;
+    CHECK (expr_cache_export (src, arc_fn, &n));
+    CHECK (n == 11);
+
+    ExprCacheArchive arc;
+    CHECK (arc.open (arc_fn));
+    CHECK (arc.size() == 11);
+    CHECK (arc.lookup (recs[0].key()) == -1);
+    for (int i=1; i<12; i++) {
+        int64_t j = arc.lookup (recs[i].key());
+        CHECK (j >= 0);
+        if (j < 0) {
+            continue;
+        }
+        CHECK (test_same_record (arc.record (j), recs[i]));
+        CHECK (arc.netlist (j, false) == test_netlist (recs[i], false));
+        CHECK (arc.netlist (j, true) == test_netlist (recs[i], true));
+    }
+    arc.close();
+
+    // into an empty cache, and then again
+    CHECK (expr_cache_import (arc_fn, dst, &added, &skipped));
+    CHECK (added == 11 && skipped == 0);
+    std::vector<expr_cache_record> j = test_journal (dst);
+    CHECK (j.size() == 11);
+    for (auto &r : j) {
+        CHECK (std::find_if (recs.begin() + 1, recs.end(), [&](const expr_cache_record &x) {
+                    return test_same_record (x, r);
+                }) != recs.end());
+        check_entry (dst, r);
+    }
+    CHECK (expr_cache_import (arc_fn, dst, &added, &skipped));
+    CHECK (added == 0 && skipped == 11);
+    CHECK (test_journal (dst).size() == 11);
+
+    // a gc of the imported cache keeps everything
+    expr_cache_gc_stats st;
+    CHECK (expr_cache_gc (dst, expr_cache_budget{0, 0}, &st));
+    CHECK (st.evicted == 0 && st.orphans == 0);
+
+    // anything else is not an archive
+    CHECK (!arc.open (src + "/" + expr_cache_index_name));
+    CHECK (!arc.open (dir + "/missing"));
+    CHECK (!expr_cache_import (dir + "/missing", dst, &added, &skipped));
+
+    fs::remove_all (dir);
+}
+
+/*
+    Publish a local cache to a global one that has some of its entries
+    already, for several batch sizes.
+*/
+static void test_publish ()
+{
+    for (uint64_t batch : { 0, 1, 4, 100 }) {
+        std::string dir = test_dir ("publish");
+        std::string src = dir + "/local", dst = dir + "/global";
+        std::vector<expr_cache_record> recs = make_cache (src, 12);
+        test_add_entry (src, recs[7]);
+        for (int i=1; i<4; i++) {
+            test_add_entry (dst, recs[i]);
+        }
+
+        uint64_t added, skipped;
+        CHECK (expr_cache_publish (src, dst, batch, &added, &skipped));
+        CHECK (added == 8 && skipped == 3);
+        std::vector<expr_cache_record> j = test_journal (dst);
+        CHECK (j.size() == 11);
+        for (int i=1; i<12; i++) {
+            CHECK (std::count_if (j.begin(), j.end(), [&](const expr_cache_record &x) {
+                        return test_same_record (x, recs[i]);
+                    }) == 1);
+            check_entry (dst, recs[i]);
+        }
+        CHECK (!fs::exists (dst + "/" + expr_cache_key_path (recs[0].key()) + ".v"));
+
+        CHECK (expr_cache_publish (src, dst, batch, &added, &skipped));
+        CHECK (added == 0 && skipped == 11);
+        CHECK (test_journal (dst).size() == 11);
+
+        // into a new global cache, which gets a header
+        std::string dst2 = dir + "/new";
+        CHECK (expr_cache_publish (src, dst2, batch, &added, &skipped));
+        CHECK (added == 11 && skipped == 0);
+        CHECK (read_file (dst2 + "/" + expr_cache_index_name).starts_with ("# expr.index "));
+        CHECK (test_journal (dst2).size() == 11);
+
+        fs::remove_all (dir);
+    }
+}
+
+int main (int argc, char **argv)
+{
+    test_round_trip ();
+    test_publish ();
+    return test_result (argv[0]);
+}
@@ -0,0 +1,243 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************
+ */
+#include "cache_test.h"
+
+/*
+    Tests of the cache index (journal lines and the binary snapshot)
+    and of gc: compaction, eviction, and removal of unused files.
+*/
+
+/* make a file look like it was written an hour and a bit ago */
+static void test_make_old (const std::string &fn)
+{
+    fs::last_write_time (fn, fs::last_write_time (fn) - std::chrono::seconds (4000));
+}
+
+static void test_lines ()
+{
+    expr_cache_record rec = test_record (7, 1000), back;
+    std::string loc = expr_cache_key_path (rec.key()), loc2;
+    std::string line = expr_cache_format_line (rec, loc);
+
+    CHECK (line.back() == '\n');
+    line.pop_back();
+    CHECK (expr_cache_parse_line (line, &back, &loc2));
+    CHECK (test_same_record (rec, back));
+    CHECK (loc2 == loc);
+    std::string hex = rec.key().hex();
+    CHECK (loc == hex.substr (0, 2) + "/" + hex.substr (2, 2) + "/" + hex);
+
+    // old style file numbers
+    std::string old = line;
+    old.replace (old.find (' '), loc.size() + 1, " 42");
+    CHECK (expr_cache_parse_line (old, &back, &loc2));
+    CHECK (back.loc == 42 && loc2 == "42");
+
+    // comments, and lines that are cut short or are not ours
+    CHECK (!expr_cache_parse_line ("# a comment", &back, &loc2));
+    CHECK (!expr_cache_parse_line ("", &back, &loc2));
+    CHECK (!expr_cache_parse_line (line.substr (0, line.size() / 2), &back, &loc2));
+    CHECK (!expr_cache_parse_line ("e1 & e2 " + line.substr (line.find (' ') + 1),
+                                   &back, &loc2));
+
+    // every new journal has a first line of its own
+    std::string h1 = expr_cache_index_header (), h2 = expr_cache_index_header ();
+    CHECK (h1.starts_with ("# expr.index "));
+    CHECK (h1.substr (0, h1.find ('\n')) != h2.substr (0, h2.find ('\n')));
+    CHECK (h1.substr (h1.find ('\n')) == h2.substr (h2.find ('\n')));
+    CHECK (expr_cache_journal_stamp (h1.substr (0, h1.find ('\n')))
+           != expr_cache_journal_stamp (h2.substr (0, h2.find ('\n'))));
+}
+
+static std::string test_rename (std::string_view text)
+{
+    std::unordered_map<std::string_view, std::string_view> rmap = {
+        { "in_0", "in_1" }, { "in_1", "in_0" }, { "out", "y" }
+    };
+    std::string res;
+    expr_cache_rename_ids (text, rmap, &res);
+    return res;
+}
+
+static void test_rename_ids ()
+{
+    // names are swapped, not renamed twice
+    CHECK (test_rename ("assign out = in_0 & in_1;\n")
+           == "assign y = in_1 & in_0;\n");
+    CHECK (test_rename ("f(.A(in_1),.B(in_0),.Y(out));")
+           == "f(.A(in_0),.B(in_1),.Y(y));");
+
+    // only whole identifiers
+    CHECK (test_rename ("in_00 xin_0 in_0$x out_ outer")
+           == "in_00 xin_0 in_0$x out_ outer");
+
+    // escaped identifiers and numbers are left alone
+    CHECK (test_rename ("\\in_0 \\out[1] in_0") == "\\in_0 \\out[1] in_1");
+    CHECK (test_rename ("4'hin_0 2'b01 8'd255;") == "4'hin_0 2'b01 8'd255;");
+    CHECK (test_rename ("wire [3:0] out;") == "wire [3:0] y;");
+    CHECK (test_rename ("") == "");
+}
+
+static void test_snapshot ()
+{
+    std::string dir = test_dir ("bidx");
+    std::string fn = dir + "/" + expr_cache_bindex_name;
+    std::vector<expr_cache_record> recs = {};
+    for (int i=0; i<100; i++) {
+        recs.push_back (test_record (i, i));
+    }
+    expr_hash stamp = expr_cache_journal_stamp ("# a journal");
+    CHECK (ExprCacheIndex::write (fn, recs, 12345, stamp));
+
+    ExprCacheIndex idx;
+    CHECK (idx.open (fn));
+    CHECK (idx.size() == recs.size());
+    CHECK (idx.journal_offset() == 12345);
+    CHECK (idx.stamp() == stamp);
+    expr_cache_record rec;
+    for (auto &r : recs) {
+        CHECK (idx.lookup (r.key(), &rec) && test_same_record (r, rec));
+    }
+    CHECK (!idx.lookup (test_record (100, 0).key(), &rec));
+    uint64_t n = 0;
+    idx.for_each ([&](const expr_cache_record &) { n++; });
+    CHECK (n == recs.size());
+    idx.close();
+
+    // anything else is not a snapshot
+    write_file (fn, "not a snapshot");
+    CHECK (!idx.open (fn));
+    CHECK (!idx.open (dir + "/missing"));
+    fs::remove_all (dir);
+}
+
+/*
+    A cache with 20 entries, one of them listed twice; entry i is
+    worth i. Entry 7 is from before the sharded layout. Entry 0 has
+    lost its netlist, and there are files of entries that are not in
+    the index: an old one, and one that is being added.
+*/
+static void test_gc ()
+{
+    std::string dir = test_dir ("gc");
+    std::vector<expr_cache_record> recs = {};
+    for (int i=0; i<20; i++) {
+        recs.push_back (test_record (i, 10 * i));
+        if (i == 7) {
+            recs.back().loc = 7;
+        }
+        test_add_entry (dir, recs.back());
+    }
+    test_add_entry (dir, recs[5]);
+    std::string first = read_file (dir + "/" + expr_cache_index_name);
+    first.resize (first.find ('\n'));
+    fs::remove (dir + "/" + test_loc (recs[0]) + ".v");
+    std::string orphan_fn = dir + "/" + test_loc (test_record (98, 0)) + ".v";
+    std::string new_fn = dir + "/" + test_loc (test_record (99, 0)) + ".v";
+    write_file (orphan_fn, "module orphan\n");
+    test_make_old (orphan_fn);
+    write_file (new_fn, "module new\n");
+
+    // uses: the first two entries are worth more than the rest; one
+    // run has written a segment of its own since the last gc
+    write_file (dir + "/" + expr_cache_access_name,
+                recs[1].key().hex() + " 100 5\n" + recs[2].key().hex() + " 100 5\n"
+                + recs[3].key().hex() + " 2 3\n");
+    std::string seg_fn = dir + "/" + expr_cache_access_name + ".7.host.42";
+    write_file (seg_fn, recs[3].key().hex() + " 2 7\n");
+
+    // no budget: only compaction
+    expr_cache_gc_stats st;
+    CHECK (expr_cache_gc (dir, expr_cache_budget{0, 0}, &st));
+    CHECK (st.entries == 20);
+    CHECK (st.evicted == 1);
+    CHECK (st.orphans == 1);
+    CHECK (!fs::exists (orphan_fn));
+    CHECK (fs::exists (new_fn));
+    std::vector<expr_cache_record> j = test_journal (dir);
+    CHECK (j.size() == 19);
+    for (size_t i=0; i<j.size(); i++) {
+        CHECK (test_same_record (j[i], recs[i+1]));
+    }
+
+    // a new first line, which replaces the old one, and a snapshot
+    // of the whole index that is tied to it
+    std::string idx_s = read_file (dir + "/" + expr_cache_index_name);
+    std::string new_first = idx_s.substr (0, idx_s.find ('\n'));
+    CHECK (new_first != first);
+    CHECK (idx_s.find (first) == std::string::npos);
+    ExprCacheIndex idx;
+    CHECK (idx.open (dir + "/" + expr_cache_bindex_name));
+    CHECK (idx.size() == 19);
+    CHECK (idx.journal_offset() == idx_s.size());
+    CHECK (idx.stamp() == expr_cache_journal_stamp (new_first));
+    expr_cache_record rec;
+    for (int i=1; i<20; i++) {
+        CHECK (idx.lookup (recs[i].key(), &rec) && test_same_record (recs[i], rec));
+    }
+    idx.close();
+
+    // the segment is merged, and the uses are halved
+    CHECK (!fs::exists (seg_fn));
+    std::string acc = read_file (dir + "/" + expr_cache_access_name);
+    CHECK (acc.find (recs[1].key().hex() + " 50 5\n") != std::string::npos);
+    CHECK (acc.find (recs[3].key().hex() + " 2 7\n") != std::string::npos);
+
+    // a budget of 10 entries evicts down to 9: the least used and
+    // cheapest ones go first
+    CHECK (expr_cache_gc (dir, expr_cache_budget{10, 0}, &st));
+    CHECK (st.entries == 19);
+    CHECK (st.evicted == 10);
+    CHECK (st.bytes_after < st.bytes_before);
+    j = test_journal (dir);
+    CHECK (j.size() == 9);
+    std::vector<expr_hash> kept = {};
+    for (auto &r : j) {
+        kept.push_back (r.key());
+    }
+    for (int i : { 1, 2, 13, 19 }) {
+        CHECK (std::find (kept.begin(), kept.end(), recs[i].key()) != kept.end());
+    }
+    for (int i : { 3, 4, 7, 12 }) {
+        CHECK (std::find (kept.begin(), kept.end(), recs[i].key()) == kept.end());
+        CHECK (!fs::exists (dir + "/" + test_loc (recs[i]) + ".v"));
+        CHECK (!fs::exists (dir + "/" + test_loc (recs[i]) + "pre.v"));
+    }
+    CHECK (fs::exists (dir + "/" + test_loc (recs[19]) + "pre.v"));
+
+    // a gc with nothing to do keeps everything
+    CHECK (expr_cache_gc (dir, expr_cache_budget{10, 0}, &st));
+    CHECK (st.evicted == 0 && st.orphans == 0);
+    CHECK (test_journal (dir).size() == 9);
+    CHECK (fs::exists (new_fn));
+
+    fs::remove_all (dir);
+}
+
+int main (int argc, char **argv)
+{
+    test_lines ();
+    test_rename_ids ();
+    test_snapshot ();
+    test_gc ();
+    return test_result (argv[0]);
+}
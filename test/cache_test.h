@@ -0,0 +1,143 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************
+ */
+#ifndef __CACHE_TEST_H__
+#define __CACHE_TEST_H__
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include "expr_cache_index.h"
+#include "expr_cache_gc.h"
+#include "test_check.h"
+
+#include <filesystem>
+namespace fs = std::filesystem;
+
+/*
+    Helpers for the cache tests, which only use the parts of the cache
+    that do not need ACT: the index, gc, and archives.
+*/
+
+/* a new empty directory, removed by the caller */
+static std::string test_dir (const char *name)
+{
+    std::string tmpl = (fs::temp_directory_path() / name).string() + ".XXXXXX";
+    std::vector<char> buf (tmpl.begin(), tmpl.end());
+    buf.push_back ('\0');
+    if (!mkdtemp (buf.data())) {
+        perror ("mkdtemp");
+        exit (1);
+    }
+    return buf.data();
+}
+
+/* a record with key i, and runtime (the value for eviction) rt */
+static expr_cache_record test_record (uint64_t i, int64_t rt)
+{
+    expr_cache_record rec;
+    memset (&rec, 0, sizeof (rec));
+    ExprHasher h;
+    h.add ((long) i);
+    expr_hash k = h.value();
+    rec.key_hi = k.hi;
+    rec.key_lo = k.lo;
+    rec.loc = -1;
+    for (int j=0; j<12; j++) {
+        rec.metrics[j] = 0.25 * (j + 1) + i;
+    }
+    rec.area = 10.5 + i;
+    rec.mapper_runtime = rt;
+    rec.io_runtime = 1;
+    return rec;
+}
+
+/* where the files of rec are, relative to the cache directory */
+static std::string test_loc (const expr_cache_record &rec)
+{
+    return rec.loc >= 0 ? std::to_string (rec.loc) : expr_cache_key_path (rec.key());
+}
+
+static void write_file (const std::string &fn, const std::string &s)
+{
+    fs::create_directories (fs::path (fn).parent_path());
+    std::ofstream f(fn, std::ios::binary);
+    f << s;
+}
+
+static std::string read_file (const std::string &fn)
+{
+    std::ifstream f(fn, std::ios::binary);
+    std::ostringstream buf;
+    buf << f.rdbuf();
+    return buf.str();
+}
+
+/* the netlists of the entry for rec */
+static std::string test_netlist (const expr_cache_record &rec, bool unmapped)
+{
+    return std::string ("module blk_") + rec.key().hex()
+        + (unmapped ? " (unmapped)" : "") + "\nendmodule\n";
+}
+
+/*
+    Add an entry to the cache in dir: its files, and its line at the
+    end of the journal (which gets the header if it is new).
+*/
+static void test_add_entry (const std::string &dir, const expr_cache_record &rec)
+{
+    std::string loc = test_loc (rec);
+    write_file (dir + "/" + loc + ".v", test_netlist (rec, false));
+    write_file (dir + "/" + loc + "pre.v", test_netlist (rec, true));
+    std::string idx = dir + "/" + expr_cache_index_name;
+    bool fresh = !fs::exists (idx);
+    std::ofstream f(idx, std::ios::app);
+    if (fresh) {
+        f << expr_cache_index_header();
+    }
+    f << expr_cache_format_line (rec, loc);
+}
+
+/* the records of the journal of dir, in order (duplicates included) */
+static std::vector<expr_cache_record> test_journal (const std::string &dir)
+{
+    std::vector<expr_cache_record> ret = {};
+    std::ifstream f(dir + "/" + expr_cache_index_name);
+    std::string line, loc;
+    expr_cache_record rec;
+    while (std::getline (f, line)) {
+        if (expr_cache_parse_line (line, &rec, &loc)) {
+            ret.push_back (rec);
+        }
+    }
+    return ret;
+}
+
+static bool test_same_record (const expr_cache_record &a, const expr_cache_record &b)
+{
+    return memcmp (&a, &b, sizeof (a)) == 0;
+}
+
+#endif /* __CACHE_TEST_H__ */
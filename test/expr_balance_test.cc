@@ -0,0 +1,133 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************/
+#include "expr_balance.h"
+#include "expr_test.h"
+
+/* the depth of the operator tree of e */
+static int depth (Expr *e)
+{
+  switch (e->type) {
+  case E_VAR:
+  case E_INT:
+  case E_TRUE:
+  case E_FALSE:
+    return 0;
+  case E_BUILTIN_INT:
+    return depth (e->u.e.l);
+  case E_CONCAT:
+    return std::max (depth (e->u.e.l), e->u.e.r ? depth (e->u.e.r) : 0);
+  default:
+    return 1 + std::max (depth (e->u.e.l), e->u.e.r ? depth (e->u.e.r) : 0);
+  }
+}
+
+/*
+ * Check that the reassociated expression has the value and width of
+ * the original one for random values of its variables.
+ */
+static bool same_function (std::mt19937_64 &rng, pHashtable *vw,
+			   std::vector<Expr *> &vars, Expr *orig, Expr *bal)
+{
+  std::map<Expr *, test_val> val;
+
+  for (int k=0; k < 20; k++) {
+    int w0, w1;
+    for (auto v : vars) {
+      val[v] = rng();
+    }
+    test_val v0 = test_eval (orig, vw, val, &w0);
+    test_val v1 = test_eval (bal, vw, val, &w1);
+    if (v0 != v1 || w0 != w1) {
+      fprintf (stderr, "value %llx (%d bits), reassociated %llx (%d bits)\n",
+	       v0, w0, v1, w1);
+      return false;
+    }
+  }
+  return true;
+}
+
+/* random expressions, with and without carry-save adders */
+static void test_random ()
+{
+  std::mt19937_64 rng(1);
+
+  for (int iter=0; iter < 2000; iter++) {
+    std::vector<Expr *> vars;
+    pHashtable *vw = phash_new (4);
+    Expr *e = test_random_expr (rng, vw, vars, 7);
+    int w;
+
+    if (iter % 7 == 0) {
+      /* a shared sub-expression */
+      Expr *a = test_var (vw, 4), *b = test_var (vw, 5);
+      vars.push_back (a);
+      vars.push_back (b);
+      e = test_node (E_PLUS, test_node (E_PLUS, e, a), test_node (E_XOR, e, b));
+    }
+
+    std::map<Expr *, test_val> val;
+    test_eval (e, vw, val, &w);
+    if (w <= 60) {
+      ExprBalance bal (vw, NULL);
+      bal.setCarrySave (iter % 2);
+      bal.addRoot (e);
+      CHECK (same_function (rng, vw, vars, e, bal.run (e)));
+    }
+    phash_free (vw);
+  }
+}
+
+/* a long chain turns into a balanced tree */
+static void test_chain ()
+{
+  std::mt19937_64 rng(2);
+  pHashtable *vw = phash_new (4);
+  std::vector<Expr *> vars;
+
+  for (int type : { E_PLUS, E_AND, E_XOR }) {
+    vars.clear ();
+    vars.push_back (test_var (vw, 8));
+    Expr *e = vars.back();
+    for (int i=0; i < 15; i++) {
+      vars.push_back (test_var (vw, 8));
+      e = test_node (type, e, vars.back());
+    }
+    for (int cs=0; cs < 2; cs++) {
+      ExprBalance bal (vw, NULL);
+      bal.setCarrySave (cs);
+      bal.addRoot (e);
+      Expr *f = bal.run (e);
+      CHECK (same_function (rng, vw, vars, e, f));
+      if (type != E_PLUS || !cs) {
+	/* 16 operands: four levels of two-input operators */
+	CHECK (depth (f) == 4);
+      }
+    }
+  }
+  phash_free (vw);
+}
+
+int main (int argc, char **argv)
+{
+  test_random ();
+  test_chain ();
+  return test_result (argv[0]);
+}
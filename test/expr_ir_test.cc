@@ -0,0 +1,465 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************/
+#include <algorithm>
+#include <deque>
+#include <string>
+#include "expr_ir.h"
+#include "expr_test.h"
+
+/*
+ * The leaf map and the widths for the variables of an expression:
+ * variable i is named x<i>, or x<order[i]> if an order is given.
+ */
+struct leaf_info {
+  iHashtable *map;
+  pHashtable *vw;
+  std::deque<std::string> names;
+
+  leaf_info (pHashtable *w, std::vector<Expr *> &vars,
+	     const std::vector<int> *order = NULL) {
+    map = ihash_new (4);
+    vw = w;
+    for (size_t i=0; i < vars.size(); i++) {
+      names.push_back ("x" + std::to_string (order ? (*order)[i] : i));
+      ihash_add (map, (long) vars[i])->v = (void *) names.back().c_str();
+    }
+  }
+  ~leaf_info () { ihash_free (map); }
+
+  void setup (ExprIR &ir) {
+    ir.setLeafInfo (map, [this] (Expr *e, const char *) {
+	return phash_lookup (vw, e)->i;
+      });
+  }
+};
+
+/* the Verilog that printVerilog() emits for the whole block */
+static std::string print (ExprIR &ir, std::vector<int> &tmp)
+{
+  char *buf = NULL;
+  size_t sz = 0;
+  int idx = 0;
+  FILE *fp = open_memstream (&buf, &sz);
+  ir.printVerilog (fp, "t", &idx, tmp);
+  fclose (fp);
+  std::string ret (buf, sz);
+  free (buf);
+  return ret;
+}
+
+/* every line is a wire declaration or one complete assignment */
+static bool well_formed (const std::string &v)
+{
+  size_t pos = 0;
+  while (pos < v.size()) {
+    size_t end = v.find ('\n', pos);
+    if (end == std::string::npos) {
+      return false;
+    }
+    std::string line = v.substr (pos, end - pos);
+    pos = end + 1;
+    if (line.starts_with ("\twire ")) {
+      continue;
+    }
+    if (!line.starts_with ("\tassign ") || !line.ends_with (";")
+	|| line.find (';') != line.size() - 1) {
+      fprintf (stderr, "bad line: %s\n", line.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
+/* eval() matches the reference evaluator on random expressions */
+static void test_eval ()
+{
+  std::mt19937_64 rng(3);
+
+  for (int iter=0; iter < 2000; iter++) {
+    std::vector<Expr *> vars;
+    pHashtable *vw = phash_new (4);
+    Expr *e = test_random_expr (rng, vw, vars, 6);
+    std::map<Expr *, test_val> val;
+    int w;
+
+    test_eval (e, vw, val, &w);
+    if (w > 64) {
+      phash_free (vw);
+      continue;
+    }
+
+    leaf_info li (vw, vars);
+    ExprIR ir;
+    li.setup (ir);
+    int r = ir.addRoot (e);
+    CHECK (ir.widthsKnown ());
+    CHECK (ir.node (r).width == w);
+
+    std::vector<test_val> leafval (ir.numLeaves());
+    std::vector<test_val> out;
+    for (int k=0; k < 10; k++) {
+      for (auto v : vars) {
+	val[v] = rng();
+      }
+      for (int j=0; j < ir.numLeaves(); j++) {
+	int i = atoi (ir.leaf (j).name + 1);
+	leafval[j] = val[vars[i]];
+      }
+      CHECK (ir.eval (leafval.data(), out));
+      CHECK (out[r] == test_eval (e, vw, val, &w));
+    }
+
+    std::vector<int> tmp;
+    CHECK (well_formed (print (ir, tmp)));
+    CHECK ((int)tmp.size() == ir.numNodes());
+    phash_free (vw);
+  }
+}
+
+/*
+ * Every statement ends with a single ';', including the padding
+ * of the operands of + and -.
+ */
+static void test_statements ()
+{
+  pHashtable *vw = phash_new (4);
+  std::vector<Expr *> vars;
+
+  vars.push_back (test_var (vw, 3));
+  vars.push_back (test_var (vw, 8));
+  Expr *e = test_node (E_PLUS, vars[0],
+		       test_node (E_MINUS, vars[1], test_int (300)));
+
+  leaf_info li (vw, vars);
+  ExprIR ir;
+  li.setup (ir);
+  ir.addRoot (e);
+
+  std::vector<int> tmp;
+  std::string v = print (ir, tmp);
+  CHECK (well_formed (v));
+  /* the operands are zero-extended to the width of the result */
+  CHECK (v.find ("{2'b00,t1};") != std::string::npos);
+  CHECK (v.find ("{8'b00000000,t0};") != std::string::npos);
+  phash_free (vw);
+}
+
+/* concatenations skip zero-width parts, and are 0 if all of them are */
+static void test_empty_concat ()
+{
+  pHashtable *vw = phash_new (4);
+  std::vector<Expr *> vars;
+
+  vars.push_back (test_var (vw, 4));
+  vars.push_back (test_var (vw, 2));
+  Expr *zero = test_node (E_BUILTIN_INT, vars[0], test_int (0));
+  Expr *empty = test_node (E_CONCAT, zero,
+			   test_node (E_CONCAT, zero, NULL));
+  Expr *part = test_node (E_CONCAT, zero,
+			  test_node (E_CONCAT, vars[1], NULL));
+
+  leaf_info li (vw, vars);
+  ExprIR ir;
+  li.setup (ir);
+  int r0 = ir.addRoot (empty);
+  int r1 = ir.addRoot (part);
+  CHECK (ir.node (r0).width == 0);
+  CHECK (ir.node (r1).width == 2);
+
+  std::vector<int> tmp;
+  std::string v = print (ir, tmp);
+  CHECK (well_formed (v));
+
+  char buf[64];
+  snprintf (buf, 64, "\tassign t%d = 0;\n", tmp[r0]);
+  CHECK (v.find (buf) != std::string::npos);
+  /* x0 only appears in zero-width parts, so it is not a leaf */
+  CHECK (ir.numLeaves() == 1);
+  snprintf (buf, 64, "\tassign t%d = {t%d};\n", tmp[r1],
+	    tmp[ir.leaf (0).node]);
+  CHECK (v.find (buf) != std::string::npos);
+
+  test_val leafval[1] = { 0x3 };
+  std::vector<test_val> out;
+  CHECK (ir.eval (leafval, out));
+  CHECK (out[r0] == 0 && out[r1] == 3);
+  phash_free (vw);
+}
+
+/*
+ * A copy of e in which the operands of commutative operators are
+ * swapped at random; the leaves are shared with e.
+ */
+static Expr *commute (std::mt19937_64 &rng, Expr *e)
+{
+  switch (e->type) {
+  case E_AND:
+  case E_OR:
+  case E_XOR:
+  case E_PLUS:
+  case E_MULT:
+    if (rng() % 2) {
+      return test_node (e->type, commute (rng, e->u.e.r),
+			commute (rng, e->u.e.l));
+    }
+    /* fall through */
+  case E_MINUS:
+    return test_node (e->type, commute (rng, e->u.e.l),
+		      commute (rng, e->u.e.r));
+  case E_COMPLEMENT:
+    return test_node (e->type, commute (rng, e->u.e.l), NULL);
+  default:
+    return e;
+  }
+}
+
+/*
+ * The canonical hash does not depend on the names of the leaves or
+ * on the operand order of commutative operators, and the leaf
+ * permutations of two blocks with the same hash line up their
+ * leaves: the blocks compute the same values from the same values
+ * of their canonical leaves.
+ */
+static void test_canonical ()
+{
+  std::mt19937_64 rng(4);
+
+  for (int iter=0; iter < 1000; iter++) {
+    std::vector<Expr *> vars;
+    pHashtable *vw = phash_new (4);
+    Expr *e = test_random_expr (rng, vw, vars, 6);
+    std::map<Expr *, test_val> val;
+    int w;
+
+    test_eval (e, vw, val, &w);
+    if (w > 64) {
+      phash_free (vw);
+      continue;
+    }
+
+    std::vector<int> order (vars.size());
+    for (size_t i=0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    std::shuffle (order.begin(), order.end(), rng);
+
+    leaf_info li1 (vw, vars), li2 (vw, vars, &order);
+    ExprIR ir1, ir2;
+    std::vector<int> perm1, perm2;
+    li1.setup (ir1);
+    li2.setup (ir2);
+    int r1 = ir1.addRoot (e);
+    int r2 = ir2.addRoot (commute (rng, e));
+    CHECK (ir1.canonicalHash (&perm1) == ir2.canonicalHash (&perm2));
+    CHECK ((int)perm1.size() == ir1.numLeaves());
+    CHECK (perm1.size() == perm2.size());
+    if (perm1.size() != perm2.size()) {
+      phash_free (vw);
+      continue;
+    }
+
+    std::vector<test_val> lv1 (perm1.size()), lv2 (perm2.size());
+    std::vector<test_val> out1, out2;
+    for (int k=0; k < 10; k++) {
+      for (size_t i=0; i < perm1.size(); i++) {
+	lv1[perm1[i]] = lv2[perm2[i]] = rng();
+      }
+      CHECK (ir1.eval (lv1.data(), out1));
+      CHECK (ir2.eval (lv2.data(), out2));
+      CHECK (out1[r1] == out2[r2]);
+    }
+    phash_free (vw);
+  }
+}
+
+/* blocks that differ in more than names and operand order */
+static void test_canonical_differs ()
+{
+  pHashtable *vw = phash_new (4);
+  std::vector<Expr *> vars;
+
+  for (int w : { 4, 4, 3 }) {
+    vars.push_back (test_var (vw, w));
+  }
+  Expr *a = vars[0], *b = vars[1], *c = vars[2];
+  leaf_info li (vw, vars);
+
+  auto key = [&] (Expr *e) {
+    ExprIR ir;
+    li.setup (ir);
+    ir.addRoot (e);
+    return ir.canonicalHash ();
+  };
+
+  /* the same, up to names and operand order */
+  CHECK (key (test_node (E_AND, a, c)) == key (test_node (E_AND, c, b)));
+  /* a leaf used twice is not two leaves */
+  CHECK (key (test_node (E_PLUS, a, a)) != key (test_node (E_PLUS, a, b)));
+  /* - is not commutative */
+  CHECK (key (test_node (E_MINUS, a, c)) != key (test_node (E_MINUS, c, a)));
+  /* leaf widths matter */
+  CHECK (key (test_node (E_XOR, a, b)) != key (test_node (E_XOR, a, c)));
+  /* so do operators */
+  CHECK (key (test_node (E_OR, a, b)) != key (test_node (E_XOR, a, b)));
+  phash_free (vw);
+}
+
+/* the function hash of e, with the leaf order of its canonical hash */
+static bool function_key (leaf_info &li, Expr *e, int maxbits,
+			  expr_hash *h, std::vector<int> *perm = NULL)
+{
+  ExprIR ir;
+  std::vector<int> start, p;
+  li.setup (ir);
+  ir.addRoot (e);
+  ir.canonicalHash (&start);
+  return ir.functionHash (maxbits, start, h, perm ? perm : &p);
+}
+
+/*
+ * Blocks that compute the same function of the same leaves get the
+ * same function hash, whatever their structure; others do not.
+ * Blocks that are too wide, or a maxbits above 24, get none.
+ */
+static void test_function ()
+{
+  pHashtable *vw = phash_new (4);
+  std::vector<Expr *> vars;
+
+  for (int w : { 4, 4, 3, 13, 13 }) {
+    vars.push_back (test_var (vw, w));
+  }
+  Expr *a = vars[0], *b = vars[1], *c = vars[2];
+  leaf_info li (vw, vars);
+
+  auto key = [&] (Expr *e) {
+    expr_hash h;
+    CHECK (function_key (li, e, 16, &h));
+    return h;
+  };
+  auto bnot = [] (Expr *e) { return test_node (E_COMPLEMENT, e, NULL); };
+
+  CHECK (key (test_node (E_AND, a, b)) == key (test_node (E_AND, b, a)));
+  /* De Morgan */
+  CHECK (key (bnot (test_node (E_OR, a, b)))
+	 == key (test_node (E_AND, bnot (a), bnot (b))));
+  /* a^b = (a|b)&~(a&b) */
+  CHECK (key (test_node (E_XOR, a, b))
+	 == key (test_node (E_AND, test_node (E_OR, a, b),
+			    bnot (test_node (E_AND, a, b)))));
+  /* only permutations: a negated input is another function */
+  CHECK (key (test_node (E_AND, a, b))
+	 != key (test_node (E_AND, bnot (a), b)));
+  CHECK (key (test_node (E_AND, a, b)) != key (test_node (E_OR, a, b)));
+  CHECK (key (test_node (E_AND, a, c)) != key (test_node (E_AND, a, b)));
+
+  /* never the same as the structural hash */
+  {
+    ExprIR ir;
+    std::vector<int> start, perm;
+    expr_hash h;
+    li.setup (ir);
+    ir.addRoot (test_node (E_AND, a, b));
+    expr_hash s = ir.canonicalHash (&start);
+    CHECK (ir.functionHash (16, start, &h, &perm) && h != s);
+  }
+
+  /* too wide */
+  expr_hash h;
+  Expr *wide = test_node (E_AND, vars[3], vars[4]);
+  CHECK (!function_key (li, wide, 16, &h));
+  CHECK (!function_key (li, wide, 25, &h));
+  CHECK (!function_key (li, test_node (E_AND, a, b), 25, &h));
+  CHECK (function_key (li, test_node (E_AND, a, b), 24, &h));
+  phash_free (vw);
+}
+
+/*
+ * Random blocks and renamed and commuted copies of them get the
+ * same function hash, and the leaf permutations line up their
+ * leaves.
+ */
+static void test_function_random ()
+{
+  std::mt19937_64 rng(5);
+
+  for (int iter=0; iter < 500; iter++) {
+    std::vector<Expr *> vars;
+    pHashtable *vw = phash_new (4);
+    Expr *e = test_random_expr (rng, vw, vars, 4);
+    std::map<Expr *, test_val> val;
+    int w;
+
+    test_eval (e, vw, val, &w);
+    if (w > 64) {
+      phash_free (vw);
+      continue;
+    }
+
+    std::vector<int> order (vars.size());
+    for (size_t i=0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    std::shuffle (order.begin(), order.end(), rng);
+
+    leaf_info li1 (vw, vars), li2 (vw, vars, &order);
+    Expr *e2 = commute (rng, e);
+    expr_hash h1, h2;
+    std::vector<int> perm1, perm2;
+    bool ok1 = function_key (li1, e, 12, &h1, &perm1);
+    bool ok2 = function_key (li2, e2, 12, &h2, &perm2);
+    CHECK (ok1 == ok2);
+    if (!ok1 || !ok2) {
+      phash_free (vw);
+      continue;
+    }
+    CHECK (h1 == h2);
+
+    ExprIR ir1, ir2;
+    li1.setup (ir1);
+    li2.setup (ir2);
+    int r1 = ir1.addRoot (e);
+    int r2 = ir2.addRoot (e2);
+    std::vector<test_val> lv1 (perm1.size()), lv2 (perm2.size());
+    std::vector<test_val> out1, out2;
+    for (int k=0; k < 10; k++) {
+      for (size_t i=0; i < perm1.size(); i++) {
+	lv1[perm1[i]] = lv2[perm2[i]] = rng();
+      }
+      CHECK (ir1.eval (lv1.data(), out1));
+      CHECK (ir2.eval (lv2.data(), out2));
+      CHECK (out1[r1] == out2[r2]);
+    }
+    phash_free (vw);
+  }
+}
+
+int main (int argc, char **argv)
+{
+  test_eval ();
+  test_statements ();
+  test_empty_concat ();
+  test_canonical ();
+  test_canonical_differs ();
+  test_function ();
+  test_function_random ();
+  return test_result (argv[0]);
+}
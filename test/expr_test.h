@@ -0,0 +1,173 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************/
+#ifndef __EXPR_TEST_H__
+#define __EXPR_TEST_H__
+
+#include <map>
+#include <random>
+#include <vector>
+#include "expropt.h"
+#include "test_check.h"
+
+/*
+ * Helpers for the tests of the expression passes: building
+ * expressions, and a reference evaluator with the Verilog semantics
+ * used by _printExpr(), for widths up to 64 bits.
+ */
+
+typedef unsigned long long test_val;
+
+static test_val test_mask (int w)
+{
+  return w >= 64 ? ~0ULL : ((1ULL << w) - 1);
+}
+
+static Expr *test_node (int type, Expr *l, Expr *r)
+{
+  Expr *e;
+  NEW (e, Expr);
+  e->type = type;
+  e->u.e.l = l;
+  e->u.e.r = r;
+  return e;
+}
+
+static Expr *test_int (unsigned long v)
+{
+  Expr *e;
+  NEW (e, Expr);
+  e->type = E_INT;
+  e->u.ival.v = v;
+  e->u.ival.v_extra = NULL;
+  return e;
+}
+
+/* a new variable of width w; its width is recorded in vw */
+static Expr *test_var (pHashtable *vw, int w)
+{
+  Expr *e = test_node (E_VAR, NULL, NULL);
+  phash_add (vw, e)->i = w;
+  return e;
+}
+
+/*
+ * The value of e, with the variable widths in vw and their values in
+ * val; *w is set to the width of the result.
+ */
+static test_val test_eval (Expr *e, pHashtable *vw,
+			   std::map<Expr *, test_val> &val, int *w)
+{
+  test_val l, r;
+  int lw, rw;
+
+  switch (e->type) {
+  case E_VAR:
+    *w = phash_lookup (vw, e)->i;
+    return val[e] & test_mask (*w);
+
+  case E_INT:
+    *w = act_expr_intwidth (e->u.ival.v);
+    return e->u.ival.v;
+
+  case E_TRUE:
+    *w = 1;
+    return 1;
+
+  case E_FALSE:
+    *w = 1;
+    return 0;
+
+  case E_BUILTIN_INT:
+    l = test_eval (e->u.e.l, vw, val, &lw);
+    *w = e->u.e.r ? e->u.e.r->u.ival.v : 1;
+    return l & test_mask (*w);
+
+  case E_CONCAT:
+    {
+      test_val v = 0;
+      *w = 0;
+      for (Expr *x = e; x; x = x->u.e.r) {
+	l = test_eval (x->u.e.l, vw, val, &lw);
+	if (lw > 0) {
+	  v = (v << lw) | l;
+	  *w += lw;
+	}
+      }
+      return v & test_mask (*w);
+    }
+
+  case E_COMPLEMENT:
+    l = test_eval (e->u.e.l, vw, val, &lw);
+    *w = lw;
+    return ~l & test_mask (lw);
+
+  case E_AND:
+  case E_OR:
+  case E_XOR:
+  case E_PLUS:
+  case E_MINUS:
+  case E_MULT:
+    l = test_eval (e->u.e.l, vw, val, &lw);
+    r = test_eval (e->u.e.r, vw, val, &rw);
+    *w = act_expr_bitwidth (e->type, lw, rw);
+    switch (e->type) {
+    case E_AND:   return (l & r) & test_mask (*w);
+    case E_OR:    return (l | r) & test_mask (*w);
+    case E_XOR:   return (l ^ r) & test_mask (*w);
+    case E_PLUS:  return (l + r) & test_mask (*w);
+    case E_MINUS: return (l - r) & test_mask (*w);
+    default:      return (l * r) & test_mask (*w);
+    }
+
+  default:
+    fatal_error ("test_eval: unsupported expression type %d", e->type);
+  }
+  return 0;
+}
+
+/*
+ * A random expression over +, -, &, |, ^ and ~ with a left-deep bias,
+ * like the ones CHP front-ends produce. New variables (at most 9 bits
+ * wide) are added to vw and vars.
+ */
+static Expr *test_random_expr (std::mt19937_64 &rng, pHashtable *vw,
+			       std::vector<Expr *> &vars, int depth)
+{
+  static const int ops[] = { E_PLUS, E_AND, E_OR, E_XOR, E_MINUS };
+
+  if (depth == 0 || rng() % 6 == 0) {
+    if (rng() % 5 == 0) {
+      return test_int (rng() % 50);
+    }
+    vars.push_back (test_var (vw, 1 + rng() % 9));
+    return vars.back();
+  }
+  if (rng() % 8 == 0) {
+    return test_node (E_COMPLEMENT,
+		      test_random_expr (rng, vw, vars, depth - 1), NULL);
+  }
+  int type = ops[rng() % 5];
+  Expr *l = test_random_expr (rng, vw, vars, depth - 1);
+  Expr *r = test_random_expr (rng, vw, vars, (rng() % 3) ? 0 : depth / 2);
+  return test_node (type, l, r);
+}
+
+#endif /* __EXPR_TEST_H__ */
@@ -0,0 +1,53 @@
+/*************************************************************************
+ *
+ *  This file is part of act expropt
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *
+ **************************************************************************/
+#ifndef __TEST_CHECK_H__
+#define __TEST_CHECK_H__
+
+#include <stdio.h>
+
+/*
+ * The checks of the standalone tests: a failed check is reported and
+ * counted, and the test carries on.
+ */
+
+static int test_failures = 0;
+
+#define CHECK(cond)							\
+  do {									\
+    if (!(cond)) {							\
+      fprintf (stderr, "%s:%d: check failed: %s\n",			\
+	       __FILE__, __LINE__, #cond);				\
+      test_failures++;							\
+    }									\
+  } while (0)
+
+/* the exit status of a test, once all the checks have run */
+static int test_result (const char *name)
+{
+  if (test_failures) {
+    fprintf (stderr, "%s: %d checks failed\n", name, test_failures);
+    return 1;
+  }
+  printf ("%s: ok\n", name);
+  return 0;
+}
+
+#endif /* __TEST_CHECK_H__ */
@@ -22,8 +22,12 @@
  **************************************************************************
  */
 #include "expropt.h"
+#include "expr_balance.h"
+#include "expr_ir.h"
 #include <common/int.h>
 #include <string.h>
+#include <algorithm>
+#include <vector>
 
 
 static void _collect_var_widths (std::unordered_map<std::string, int> *w,
@@ -69,6 +73,50 @@ static void _collect_var_widths (std::unordered_map<std::string, int> *w,
   return;
 }
 
+/*
+ * Canonical emission: return a copy of the list sorted by name. If
+ * names is NULL, names are found in map; otherwise names is an index
+ * aligned name list, and *snames is set to its sorted copy. The sort
+ * is stable, so duplicate names keep their relative order.
+ */
+static list_t *_sort_by_name (list_t *l, iHashtable *map,
+			      list_t *names, list_t **snames)
+{
+  std::vector<std::pair<const char *, void *> > v;
+  listitem_t *li, *li_name;
+
+  li_name = names ? list_first (names) : NULL;
+  for (li = list_first (l); li; li = list_next (li)) {
+    const char *nm;
+    if (names) {
+      Assert (li_name, "name list and expr list dont have the same length");
+      nm = (const char *) list_value (li_name);
+      li_name = list_next (li_name);
+    }
+    else {
+      nm = (const char *) ihash_lookup (map, (long) list_value (li))->v;
+    }
+    v.push_back (std::make_pair (nm, list_value (li)));
+  }
+  std::stable_sort (v.begin(), v.end(),
+		    [] (const std::pair<const char *, void *> &a,
+			const std::pair<const char *, void *> &b) {
+		      return strcmp (a.first, b.first) < 0;
+		    });
+
+  list_t *ret = list_new ();
+  if (snames) {
+    *snames = list_new ();
+  }
+  for (auto &x : v) {
+    list_append (ret, x.second);
+    if (snames) {
+      list_append (*snames, x.first);
+    }
+  }
+  return ret;
+}
+
 /*
  * print the verilog module with header, in and outputs. call the
  * expression print method for the assigns rhs.
@@ -91,12 +139,27 @@ void ExternalExprOpt::print_expr_verilog (FILE *output_stream,
 
   std::unordered_map<std::string, int> _varwidths;
 
-  struct pHashtable *_Hexpr;
   struct pHashtable *_Hwidth;
 
-  _Hexpr = phash_new (8);
   _Hwidth = phash_new (8);
-  
+
+  /* canonical emission: the ports keep their declared order, since
+     they are also the ports of the ACT process; the hidden wires and
+     all the assigns are printed in name order */
+  list_t *c_out = NULL, *c_out_names = NULL;
+  list_t *c_hidden = NULL, *c_hidden_names = NULL;
+  list_t *assign_list = out_list, *assign_names = out_expr_name_list;
+  if (_canonical) {
+    c_out = _sort_by_name (out_list, NULL, out_expr_name_list, &c_out_names);
+    assign_list = c_out;
+    assign_names = c_out_names;
+    if (expr_list && hidden_expr_name_list) {
+      c_hidden = _sort_by_name (expr_list, NULL, hidden_expr_name_list,
+				&c_hidden_names);
+      expr_list = c_hidden;
+      hidden_expr_name_list = c_hidden_names;
+    }
+  }
 
   if (!output_stream) {
     fatal_error("ExternalExprOpt::print_expr_verilog: "
@@ -268,6 +331,44 @@ void ExternalExprOpt::print_expr_verilog (FILE *output_stream,
 
   list_free (all_names);
 
+  /* the width of every variable the assigns use; this also checks
+     that all of them are known */
+  if (expr_list != NULL && hidden_expr_name_list != NULL) {
+    for (li = list_first (expr_list); li; li = list_next (li)) {
+      _collect_var_widths (&_varwidths, (Expr *) list_value (li),
+			   inexprmap, _Hwidth);
+    }
+  }
+  for (li = list_first (out_list); li; li = list_next (li)) {
+    _collect_var_widths (&_varwidths, (Expr *) list_value (li),
+			 inexprmap, _Hwidth);
+  }
+
+  /* reassociate long +, &, |, ^ chains before printing; this needs
+     all the widths, and all the roots to find shared nodes */
+  ExprBalance *bal = NULL;
+  if (config_get_int ("synth.expropt.reassociate")) {
+    bal = new ExprBalance (_Hwidth, inexprmap);
+    bal->setCarrySave (config_get_int ("synth.expropt.carry_save_adders") != 0);
+    if (expr_list != NULL && hidden_expr_name_list != NULL) {
+      for (li = list_first (expr_list); li; li = list_next (li)) {
+	bal->addRoot ((Expr *) list_value (li));
+      }
+    }
+    for (li = list_first (out_list); li; li = list_next (li)) {
+      bal->addRoot ((Expr *) list_value (li));
+    }
+  }
+
+  /* the assigns are printed from the flattened block; nodes shared
+     between assigns are printed once */
+  ExprIR ir;
+  std::vector<int> tmp;
+  ir.setLeafInfo (inexprmap, [&] (Expr *, const char *nm) -> int {
+      auto it = _varwidths.find (nm);
+      return it == _varwidths.end() ? -1 : it->second;
+    });
+
   //the hidden logic statements
   repeats = hash_new (4);
   if (expr_list != NULL && hidden_expr_name_list != NULL && !list_isempty(expr_list) && !list_isempty(hidden_expr_name_list))
@@ -278,7 +379,8 @@ void ExternalExprOpt::print_expr_verilog (FILE *output_stream,
     {
       Expr *e = (Expr*) list_value (li);
       Assert(li_name, "output name list and output expr list dont have the same length");
-      std::string current = (char *) list_value (li_name);
+      const char *nm = (const char *) list_value (li_name);
+      std::string current = nm;
       bool skip = false;
       if (hash_lookup (repeats, current.c_str())) {
 	skip = true;
@@ -290,46 +392,153 @@ void ExternalExprOpt::print_expr_verilog (FILE *output_stream,
       if (skip) continue;
      // also print the hidden assigns
 
-      /* now walk through the expression, and save the variable widths */
-      _collect_var_widths (&_varwidths, e, inexprmap, _Hwidth);
-      int dummy_w;
-      int idx = _printExpr (output_stream, e, NULL, _dummy_prefix, &_dummy_idx,
-			    _Hexpr, _Hwidth, inexprmap, &dummy_w);
-      auto buf = _gen_dummy_id(idx);
+      if (bal) {
+	e = bal->run (e);
+      }
+      int n = ir.addRoot (e, _varwidths[current], nm);
+      ir.printVerilog (output_stream, _dummy_prefix, &_dummy_idx, tmp, n);
+      auto buf = _gen_dummy_id(tmp[n]);
       fprintf(output_stream,"\tassign %s = %s;\n", current.c_str(), buf.c_str());
     }
   }
 
   //the actuall logic statements
   fprintf(output_stream, "\n\t// the actuall logic statements as assigns\n");
-  li_name = list_first (out_expr_name_list);
-  for (li = list_first (out_list); li; li = list_next (li))
+  li_name = list_first (assign_names);
+  for (li = list_first (assign_list); li; li = list_next (li))
   {
     Expr *e = (Expr*) list_value (li);
     std::string current = (char *) list_value (li_name);
 
-    /* now walk through the expression, and save the variable widths */
-    _collect_var_widths (&_varwidths, e, inexprmap, _Hwidth);
-    int dummy_w;
-    int idx = _printExpr (output_stream, e, NULL, _dummy_prefix, &_dummy_idx,
-			  _Hexpr, _Hwidth, inexprmap, &dummy_w);
-    auto buf = _gen_dummy_id(idx);
+    if (bal) {
+      e = bal->run (e);
+    }
+    int n = ir.addRoot (e, _varwidths[current],
+			(const char *) list_value (li_name));
+    ir.printVerilog (output_stream, _dummy_prefix, &_dummy_idx, tmp, n);
+    auto buf = _gen_dummy_id(tmp[n]);
     fprintf(output_stream,"\tassign %s = %s;\n", current.c_str(), buf.c_str());
     li_name = list_next(li_name);
   }
   fprintf(output_stream, "\nendmodule\n");
 
-  phash_free (_Hexpr);
+  if (bal) {
+    delete bal;
+  }
+
   phash_free (_Hwidth);
+
+  if (c_out) {
+    list_free (c_out);
+    list_free (c_out_names);
+  }
+  if (c_hidden) {
+    list_free (c_hidden);
+    list_free (c_hidden_names);
+  }
+}
+
+
+std::string ExternalExprOpt::verilog_signature (list_t *in_expr_list,
+						iHashtable *in_expr_map,
+						iHashtable *in_width_map,
+						list_t *out_expr_list,
+						list_t *out_expr_name_list,
+						iHashtable *out_width_map,
+						list_t *hidden_expr_list,
+						list_t *hidden_expr_name_list)
+{
+  char *buf = NULL;
+  size_t sz = 0;
+  FILE *fp = open_memstream (&buf, &sz);
+  if (!fp) {
+    fatal_error ("ExternalExprOpt::verilog_signature: open_memstream failed");
+  }
+
+  /* the emitted module keeps the port order of the ACT process; the
+     signature sorts the ports as well, so that it does not depend on
+     the order the ports are listed in */
+  list_t *s_out_names;
+  list_t *s_in = _sort_by_name (in_expr_list, in_expr_map, NULL, NULL);
+  list_t *s_out = _sort_by_name (out_expr_list, NULL, out_expr_name_list,
+				 &s_out_names);
+
+  /* fixed module name, so that only the block contents matter */
+  bool save = _canonical;
+  _canonical = true;
+  print_expr_verilog (fp, "expr_block",
+		      s_in, in_expr_map, in_width_map,
+		      s_out, s_out_names, out_width_map,
+		      hidden_expr_list, hidden_expr_name_list);
+  _canonical = save;
+  fclose (fp);
+
+  list_free (s_in);
+  list_free (s_out);
+  list_free (s_out_names);
+
+  ExprHasher h;
+  h.add (buf, sz);
+  free (buf);
+  return h.value().hex();
+}
+
+ExprPrintContext::ExprPrintContext (Scope *sc)
+{
+  _sc = sc;
+  _namew = hash_new (8);
+  _emap = phash_new (8);
+  _wmap = phash_new (8);
+}
+
+ExprPrintContext::~ExprPrintContext ()
+{
+  hash_free (_namew);
+  phash_free (_emap);
+  phash_free (_wmap);
+}
+
+void ExprPrintContext::clear ()
+{
+  hash_clear (_namew);
 }
 
-static void _collect_vwidths (Scope *sc,
+/*
+ * The cache is keyed by the printed identifier rather than the ActId
+ * pointer, since expressions (and their ids) are freed and
+ * re-allocated between printExpr() calls.
+ */
+int ExprPrintContext::idWidth (ActId *id)
+{
+  hash_bucket_t *b;
+  const char *nm;
+  char buf[char_buf_sz];
+
+  if (!id->Rest() && !id->arrayInfo()) {
+    nm = id->getName();
+  }
+  else {
+    id->sPrint (buf, char_buf_sz);
+    nm = buf;
+  }
+
+  b = hash_lookup (_namew, nm);
+  if (!b) {
+    InstType *it = _sc->FullLookup (id, NULL);
+    Assert (it, "ID not found in scope?!");
+    b = hash_add (_namew, nm);
+    b->i = TypeFactory::totBitWidth (it);
+  }
+  return b->i;
+}
+
+static void _collect_vwidths (ExprPrintContext *ctx,
 			      struct pHashtable *H,
 			      struct pHashtable *tmp,
 			      Expr *e)
 {
   phash_bucket_t *pb;
-  if (!sc || !e) return;
+  if (!ctx->getScope() || !e) return;
 
   /* in case we have edags */
   if (phash_lookup (tmp, e)) return;
@@ -346,21 +555,19 @@ static void _collect_vwidths (Scope *sc,
   case E_VAR:
     if (!phash_lookup (H, e)) {
       ActId *id = (ActId *) e->u.e.l;
-      InstType *it = sc->FullLookup (id, NULL);
-      Assert (it, "ID not found in scope?!");
       pb = phash_add (H, e);
-      pb->i = TypeFactory::totBitWidth (it);
+      pb->i = ctx->idWidth (id);
 
       if (id->isDynamicDeref()) {
 	// XXX: multi-dimensional arrays?!
-	_collect_vwidths (sc, H, tmp, id->arrayInfo()->getDeref(0));
+	_collect_vwidths (ctx, H, tmp, id->arrayInfo()->getDeref(0));
       }
     }
     break;
 
   default:
-    _collect_vwidths (sc, H, tmp, e->u.e.l);
-    _collect_vwidths (sc, H, tmp, e->u.e.r);
+    _collect_vwidths (ctx, H, tmp, e->u.e.l);
+    _collect_vwidths (ctx, H, tmp, e->u.e.r);
     break;
   }
 }
@@ -368,22 +575,32 @@ static void _collect_vwidths (Scope *sc,
 
 int ExternalExprOpt::printExpr (FILE *fp, Expr *e, Scope *sc,
 				const char *prefix, int *idx,
-				iHashtable *leafmap)
+				iHashtable *leafmap, bool canonical)
+{
+  ExprPrintContext ctx(sc);
+  return printExpr (fp, e, &ctx, prefix, idx, leafmap, canonical);
+}
+
+int ExternalExprOpt::printExpr (FILE *fp, Expr *e, ExprPrintContext *ctx,
+				const char *prefix, int *idx,
+				iHashtable *leafmap, bool canonical)
 {
   int ret;
   int w;
-  struct pHashtable *emap, *wmap;
-
-  emap = phash_new (4);
-  wmap = phash_new (4);
 
-  _collect_vwidths (sc, wmap, emap, e);
-  phash_clear (emap);
+  /* per-expression tables; the allocation is reused across calls */
+  phash_clear (ctx->_emap);
+  phash_clear (ctx->_wmap);
 
-  ret = _printExpr (fp, e, sc, prefix, idx, emap, wmap, leafmap, &w);
+  _collect_vwidths (ctx, ctx->_wmap, ctx->_emap, e);
+  phash_clear (ctx->_emap);
 
-  phash_free (emap);
-  phash_free (wmap);
+  /* the widths are all in _wmap now, so _printExpr() only needs the
+     scope to pick fresh temporary names; in canonical mode it gets
+     none, and numbers the temporaries from *idx instead */
+  Scope *fresh = canonical ? NULL : ctx->getScope();
+  ret = _printExpr (fp, e, fresh, prefix, idx,
+		    ctx->_emap, ctx->_wmap, leafmap, &w);
 
   return ret;
 }
@@ -840,7 +1057,7 @@ int ExternalExprOpt::_printExpr (FILE *fp, Expr *e, Scope *sc,
       lidx = _printExpr (fp, e->u.e.l, sc, prefix, idx,
 			 emap, wmap, leafmap, &lw);
 
-      if (l >= lw) {
+      if (l >= (unsigned int)lw) {
 	// invalid bitfield specifier
 	l = lw-1;
 	if (r > l) {
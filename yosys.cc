@@ -77,7 +77,7 @@ static double parse_yosys_info (std::string file, double *area)
   }
 
   ret = -1;
-  for (i=0; i < sizeof (_cell_info)/sizeof (_cell_info[0]); i++) {
+  for (i=0; i < (int)(sizeof (_cell_info)/sizeof (_cell_info[0])); i++) {
     _cell_info[i].count = 0;
   }
 
@@ -118,7 +118,7 @@ static double parse_yosys_info (std::string file, double *area)
 	}
 	if (*tmp && count > 0) {
 	  int i;
-	  for (i=0; i < sizeof (_cell_info)/sizeof (_cell_info[0]); i++) {
+	  for (i=0; i < (int)(sizeof (_cell_info)/sizeof (_cell_info[0])); i++) {
 	    if (strcmp (cell_name, _cell_info[i].name) == 0) {
 	      _cell_info[i].count++;
 	      break;
@@ -135,7 +135,7 @@ static double parse_yosys_info (std::string file, double *area)
     int i;
     *area = 0;
 
-    for (i=0; i < sizeof (_cell_info)/sizeof (_cell_info[0]); i++) {
+    for (i=0; i < (int)(sizeof (_cell_info)/sizeof (_cell_info[0])); i++) {
       *area += _cell_info[i].area * _cell_info[i].count;
     }
     // in um^2, so SI units